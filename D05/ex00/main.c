@@ -6,6 +6,7 @@
 #include <util/delay.h>
 
 #define CHK_BITS(reg, mask) ((reg & mask) == mask)
+#define COUNT_ADDR 42 // start of the wear-levelled region of the counter
 
 void	uart_init()
 {
@@ -94,6 +95,66 @@ unsigned char EEPROM_read(unsigned int uiAddress)
 	return EEDR;
 }
 
+/*********************WEAR-LEVELLED COUNTER*************************/
+// a cell takes ~100k writes, so the value rotates over WEAR_SLOTS bytes : write n goes
+// to slot n % WEAR_SLOTS, bit 7 of the slot is the lap parity (flips at every wrap) and
+// bits 0-6 the value. Slots [0, pos] share the parity of slot 0 and the others don't,
+// so the current slot is found with a binary search, every update is one byte write.
+// WEAR_SLOTS times the endurance of a single address.
+#define WEAR_SLOTS 16
+#define WEAR_LAP 0x80
+#define WEAR_EMPTY 0x7F // erased slot value, never written : values go from 0 to 126
+
+typedef struct	s_wear
+{
+	uint16_t	base;
+	uint8_t		pos; // slot of the current value
+	uint8_t		lap; // its parity
+	uint8_t		value;
+}	t_wear;
+
+void	wear_init(t_wear *c, uint16_t base)
+{
+	uint8_t	low = 0;
+	uint8_t	high = WEAR_SLOTS - 1;
+	uint8_t	first = EEPROM_read(base);
+
+	c->base = base;
+	c->lap = first & WEAR_LAP;
+	// last slot with the parity of slot 0
+	while (low < high)
+	{
+		uint8_t	mid = (low + high + 1) / 2;
+		if ((EEPROM_read(base + mid) & WEAR_LAP) == c->lap)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	c->pos = low;
+	c->value = EEPROM_read(base + low) & ~WEAR_LAP;
+	if (c->value == WEAR_EMPTY) // fresh EEPROM
+		c->value = 0;
+}
+
+uint8_t	wear_get(t_wear *c)
+{
+	return (c->value);
+}
+
+void	wear_set(t_wear *c, uint8_t value)
+{
+	if (value == c->value)
+		return ;
+	c->pos++;
+	if (c->pos == WEAR_SLOTS) // fresh EEPROM lands here too : erased slots read as lap 1
+	{
+		c->pos = 0;
+		c->lap ^= WEAR_LAP;
+	}
+	c->value = value;
+	EEPROM_write(c->base + c->pos, c->lap | value);
+}
+
 void debounce_SW1(void)
 {
     for (uint32_t i = 0; i < (F_CPU * 6); ++i)
@@ -107,31 +168,28 @@ void debounce_SW1(void)
 
 int	main()
 {
+	t_wear	count;
+
 	DDRD &= ~(1 << DDD2); //button SW1 input
 	DDRB |= (1 << DDB0);
 	DDRB |= (1 << DDB1);
 	DDRB |= (1 << DDB2);
 	DDRB |= (1 << DDB4);
 	uart_init();
+	wear_init(&count, COUNT_ADDR);
 
 	while (1)
 	{
 		if (!(PIND & (1 << PIND2)))
 		{
 			lights_off();
-			EEPROM_read(42);
-			EEDR += 1;
-			EEPROM_write(42, EEDR); // writes count value at address 42
+			// one byte write, never twice in a row on the same cell
+			wear_set(&count, (wear_get(&count) + 1) % 4);
 			while (!(PIND & (1 << PIND2)));
 			debounce_SW1();
 		}
 
-		// doc 8.6.2 : EEDR as data register for what is written or read
-		EEPROM_read(42);
-		if (EEDR == 4)
-			EEPROM_write(42, 0);
-
-		switch(EEDR) {
+		switch(wear_get(&count)) {
 			case 0:
 				PORTB |= (1 << PORTB0);
 				break;
@@ -93,6 +93,66 @@ unsigned char EEPROM_read(unsigned int uiAddress)
 	return EEDR;
 }
 
+/*********************WEAR-LEVELLED COUNTER*************************/
+// a cell takes ~100k writes, so the value rotates over WEAR_SLOTS bytes : write n goes
+// to slot n % WEAR_SLOTS, bit 7 of the slot is the lap parity (flips at every wrap) and
+// bits 0-6 the value. Slots [0, pos] share the parity of slot 0 and the others don't,
+// so the current slot is found with a binary search, every update is one byte write.
+// WEAR_SLOTS times the endurance of a single address.
+#define WEAR_SLOTS 16
+#define WEAR_LAP 0x80
+#define WEAR_EMPTY 0x7F // erased slot value, never written : values go from 0 to 126
+
+typedef struct	s_wear
+{
+	uint16_t	base;
+	uint8_t		pos; // slot of the current value
+	uint8_t		lap; // its parity
+	uint8_t		value;
+}	t_wear;
+
+void	wear_init(t_wear *c, uint16_t base)
+{
+	uint8_t	low = 0;
+	uint8_t	high = WEAR_SLOTS - 1;
+	uint8_t	first = EEPROM_read(base);
+
+	c->base = base;
+	c->lap = first & WEAR_LAP;
+	// last slot with the parity of slot 0
+	while (low < high)
+	{
+		uint8_t	mid = (low + high + 1) / 2;
+		if ((EEPROM_read(base + mid) & WEAR_LAP) == c->lap)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	c->pos = low;
+	c->value = EEPROM_read(base + low) & ~WEAR_LAP;
+	if (c->value == WEAR_EMPTY) // fresh EEPROM
+		c->value = 0;
+}
+
+uint8_t	wear_get(t_wear *c)
+{
+	return (c->value);
+}
+
+void	wear_set(t_wear *c, uint8_t value)
+{
+	if (value == c->value)
+		return ;
+	c->pos++;
+	if (c->pos == WEAR_SLOTS) // fresh EEPROM lands here too : erased slots read as lap 1
+	{
+		c->pos = 0;
+		c->lap ^= WEAR_LAP;
+	}
+	c->value = value;
+	EEPROM_write(c->base + c->pos, c->lap | value);
+}
+
 void debounce_SW1(void)
 {
     for (uint32_t i = 0; i < (F_CPU * 6); ++i)
@@ -105,6 +165,10 @@ void debounce_SW1(void)
 
 // Magic numbers : F0 (240) = counter selector
 // A0 (160) && A1 (161) | B0 (176) | C0 (192) | D0(108)
+// each value has its own wear-levelled region : the selector at 0xF1 and the
+// 4 counters from address 0, WEAR_SLOTS bytes each
+#define SELECT_ADDR 0xF1
+#define COUNTER_ADDR(i) ((i) * WEAR_SLOTS)
 
 void	manage_lights(int counter)
 {
@@ -128,6 +192,10 @@ void	manage_lights(int counter)
 
 int	main()
 {
+	t_wear	selector;
+	t_wear	counters[4];
+	uint8_t	i = 0;
+
 	DDRD &= ~(1 << DDD2); //button SW1 input
 	DDRD &= ~(1 << DDD4);
 	DDRB |= (1 << DDB0);
@@ -136,9 +204,13 @@ int	main()
 	DDRB |= (1 << DDB4);
 	uart_init();
 
-	EEPROM_read(0xF1);
-	EEPROM_read(EEDR); // what the current counter ?
-	manage_lights(EEDR);
+	wear_init(&selector, SELECT_ADDR);
+	while (i < 4)
+	{
+		wear_init(&counters[i], COUNTER_ADDR(i));
+		i++;
+	}
+	manage_lights(wear_get(&counters[wear_get(&selector) % 4])); // what the current counter ?
 
 	while (1)
 	{
@@ -146,17 +218,9 @@ int	main()
 		if (!(PIND & (1 << PIND4)))
 		{
 			lights_off();
-			EEPROM_read(0xF1); // what's the current counter ?
-			EEDR += 1;
-			if (EEDR == 4) // is it above the max counter number ?
-				EEPROM_write(0xF1, 0);
-			else
-				EEPROM_write(0xF1, EEDR); // normal case
-
-
-			EEPROM_read(0xF1);
-			EEPROM_read(EEDR); // what the current counter ?
-			manage_lights(EEDR);
+			// one byte write, on the next slot of the selector region
+			wear_set(&selector, (wear_get(&selector) + 1) % 4);
+			manage_lights(wear_get(&counters[wear_get(&selector)])); // what the current counter ?
 			while (!(PIND & (1 << PIND4)));
 			debounce_SW1();
 		}
@@ -165,18 +229,9 @@ int	main()
 		if (!(PIND & (1 << PIND2)))
 		{
 			lights_off();
-			EEPROM_read(0xF1); // what is the current counter ?
-			uint8_t	counter = EEDR;
-			EEPROM_read(EEDR);
-			EEDR += 1;
-			if (EEDR == 4)
-			{
-				EEPROM_write(counter, 0);
-				EEDR = 0;
-			}
-			else
-				EEPROM_write(counter, EEDR);
-			manage_lights(EEDR);
+			t_wear	*counter = &counters[wear_get(&selector) % 4]; // what is the current counter ?
+			wear_set(counter, (wear_get(counter) + 1) % 4);
+			manage_lights(wear_get(counter));
 
 			while (!(PIND & (1 << PIND2)));
 			debounce_SW1();
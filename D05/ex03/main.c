@@ -1,5 +1,6 @@
 #include <avr/io.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
 #include <stdbool.h>
 
 #define MAGIC_NUMBER 0xE1E1
@@ -76,42 +77,294 @@ void uart_printhex(uint8_t byte)
 	//nibble = 4 bits
 }
 
-void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+void	uart_printnumber(uint32_t n)
+{
+	if (n >= 10)
+	{
+		uart_printnumber(n / 10);
+		uart_printnumber(n % 10);
+	}
+	else
+		uart_tx(n + '0');
+}
+
+/*********************EEPROM WRITE QUEUE*************************/
+// a write takes 3.4 ms (doc 8.4 - Table 8-2) and the datasheet EEPROM_write spins on EEPE
+// before each byte, so a header + body kept the CPU busy for tens of ms.
+// EEPROM_write now only queues (address, data) and returns, EE_READY_vect starts the next
+// write each time the previous one is done. The queue is FIFO and never merges entries :
+// the allocator relies on its writes reaching the EEPROM in order.
+// Each write reads the cell first : unchanged bytes are dropped and the programming mode
+// is chosen per byte (eepm_select), clear_eeprom only costs erase cycles.
+// EEPROM_read_cell looks in the queue first, so it always returns what was last written.
+// Global interrupts have to be enabled (sei) for the queue to drain.
+#define EEQ_SIZE 32 // pending writes, 3 bytes of SRAM each
+
+typedef struct	s_eeq
+{
+	uint16_t	addr;
+	uint8_t		data;
+}	t_eeq;
+
+volatile t_eeq		eeq[EEQ_SIZE];
+volatile uint8_t	eeq_head = 0; // next free entry
+volatile uint8_t	eeq_tail = 0; // next write to start
+volatile uint8_t	eeq_count = 0;
+void				(*eeq_done)(void) = 0; // called from the ISR once the queue is empty
+
+// doc 8.6.3 - Table 8-1 : EEPM1:0 picks the programming mode of the next write
+#define EEPM_ATOMIC 0 // erase + write, 3.4 ms
+#define EEPM_ERASE 1 // every bit to 1, 1.8 ms
+#define EEPM_WRITE 2 // only clears bits, 1.8 ms
+
+typedef struct	s_eeq_stats
+{
+	uint16_t	atomic;
+	uint16_t	erase;
+	uint16_t	write;
+	uint16_t	skip; // already holds the data
+}	t_eeq_stats;
+
+volatile t_eeq_stats	eeq_stats = {0, 0, 0, 0};
+uint32_t				eeq_cell_reads = 0; // cells read from the EEPROM itself (EERE)
+
+// cheapest mode that turns old into data : an erased cell can only lose bits
+uint8_t	eepm_select(uint8_t old, uint8_t data)
+{
+	if (data == 0xFF)
+		return (EEPM_ERASE);
+	if ((old & data) == data)
+		return (EEPM_WRITE);
+	return (EEPM_ATOMIC);
+}
+
+// doc 8.6.3 : EE_READY fires as long as EEPE is clear and EERIE is set
+ISR(EE_READY_vect)
+{
+	uint8_t	old;
+	uint8_t	mode;
+
+	while (eeq_count)
+	{
+		/* Set up address and Data Registers */
+		EEAR = eeq[eeq_tail].addr;
+		// EEPE is clear in here, the cell can be read before programming it
+		EECR |= (1<<EERE);
+		old = EEDR;
+		EEDR = eeq[eeq_tail].data;
+		eeq_tail = (eeq_tail + 1) % EEQ_SIZE;
+		eeq_count--;
+		if (old == EEDR)
+		{
+			eeq_stats.skip++;
+			continue ;
+		}
+		mode = eepm_select(old, EEDR);
+		if (mode == EEPM_ERASE)
+			eeq_stats.erase++;
+		else if (mode == EEPM_WRITE)
+			eeq_stats.write++;
+		else
+			eeq_stats.atomic++;
+		EECR = (EECR & ~((1 << EEPM1) | (1 << EEPM0))) | (mode << EEPM0);
+		// interrupts are off in here, EEPE comes within 4 cycles after EEMPE
+		/* Write logical one to EEMPE */
+		EECR |= (1<<EEMPE);
+		/* Start eeprom write by setting EEPE */
+		EECR |= (1<<EEPE);
+		return ;
+	}
+	EECR &= ~(1 << EERIE);
+	if (eeq_done)
+		eeq_done();
+}
+
+// poll flag : true while writes are pending or the last one is still going
+bool	EEPROM_busy()
+{
+	return (eeq_count || (EECR & (1 << EEPE)));
+}
+
+void	EEPROM_flush()
+{
+	while (EEPROM_busy())
+	{}
+}
+
+// newest pending write to addr, called with interrupts off
+bool	eeq_find(uint16_t addr, uint8_t *data)
+{
+	uint8_t	i = eeq_count;
+
+	while (i > 0)
+	{
+		uint8_t	e = (eeq_tail + i - 1) % EEQ_SIZE;
+		if (eeq[e].addr == addr)
+		{
+			*data = eeq[e].data;
+			return (true);
+		}
+		i--;
+	}
+	return (false);
+}
+
+// n (8 at most) cells from addr in one critical section : one wait on EEPE for all of
+// them, none if they are all still in the queue
+void	EEPROM_read_cells(uint16_t addr, uint8_t *data, uint8_t n)
+{
+	uint8_t	sreg = SREG;
+	uint8_t	queued;
+	uint8_t	k;
+
+	while (1)
+	{
+		cli();
+		queued = 0;
+		k = 0;
+		while (k < n)
+		{
+			if (eeq_find(addr + k, &data[k]))
+				queued |= 1 << k;
+			k++;
+		}
+		// doc 8.6.1 : no read while a write is going, with interrupts off the ISR can't start one
+		if (queued == (uint8_t)((1 << n) - 1) || !(EECR & (1<<EEPE)))
+			break ;
+		// the write takes up to 3.4 ms : wait for it with interrupts on, the ISR may have
+		// started the next one (or taken our addresses out of the queue) before cli()
+		SREG = sreg;
+		/* Wait for completion of previous write */
+		while(EECR & (1<<EEPE));
+	}
+	k = 0;
+	while (k < n)
+	{
+		if (!(queued & (1 << k)))
+		{
+			/* Set up address register */
+			EEAR = addr + k;
+			/* Start eeprom read by writing EERE */
+			EECR |= (1<<EERE);
+			/* Return data from Data Register */
+			data[k] = EEDR;
+			eeq_cell_reads++;
+		}
+		k++;
+	}
+	SREG = sreg;
+}
+
+unsigned char EEPROM_read_cell(unsigned int uiAddress)
+{
+	uint8_t	data;
+
+	EEPROM_read_cells(uiAddress, &data, 1);
+	return (data);
+}
+
+/*********************EEPROM READ CACHE*************************/
+// direct mapped, EE_CACHE_LINES lines of EE_CACHE_LINE bytes. A header sits in one or
+// two lines, reading it again (EEPROM_update before every write, commit_write,
+// index_build) is a compare in SRAM instead of the EEAR / EERE round trip.
+// Write-through : EEPROM_write updates the line and still queues the write, a line is
+// never dirty. Footprint is EE_CACHE_LINES * (EE_CACHE_LINE + 2) bytes of SRAM,
+// -DEE_CACHE_LINES=0 takes it out. ee_cache_hits / ee_cache_misses are there to tune it.
+#ifndef EE_CACHE_LINES
+# define EE_CACHE_LINES 16
+#endif
+#ifndef EE_CACHE_LINE
+# define EE_CACHE_LINE 4 // power of 2 up to 8, a whole line is read on a miss
+#endif
+
+#if EE_CACHE_LINES
+typedef struct	s_ee_line
 {
-	/* Wait for completion of previous write */
-	while(EECR & (1<<EEPE));
-	/* Set up address and Data Registers */
-	EEAR = uiAddress;
-	EEDR = ucData;
-	/* Write logical one to EEMPE */
-	EECR |= (1<<EEMPE);
-	/* Start eeprom write by setting EEPE */
-	EECR |= (1<<EEPE);
+	uint16_t	tag; // address / EE_CACHE_LINE + 1, 0 is an empty line (bss starts at 0)
+	uint8_t		data[EE_CACHE_LINE];
+}	t_ee_line;
+
+t_ee_line	ee_cache[EE_CACHE_LINES];
+uint32_t	ee_cache_hits = 0;
+uint32_t	ee_cache_misses = 0;
+
+t_ee_line	*ee_cache_line(uint16_t addr)
+{
+	return (&ee_cache[(addr / EE_CACHE_LINE) % EE_CACHE_LINES]);
 }
 
 unsigned char EEPROM_read(unsigned int uiAddress)
 {
-	/* Wait for completion of previous write */
-	while(EECR & (1<<EEPE));
-	/* Set up address register */
-	EEAR = uiAddress;
-	/* Start eeprom read by writing EERE */
-	EECR |= (1<<EERE);
-	/* Return data from Data Register */
-	return EEDR;
+	t_ee_line	*line = ee_cache_line(uiAddress);
+	uint16_t	base = uiAddress & ~(EE_CACHE_LINE - 1);
+
+	if (line->tag == uiAddress / EE_CACHE_LINE + 1)
+	{
+		ee_cache_hits++;
+		return (line->data[uiAddress - base]);
+	}
+	ee_cache_misses++;
+	EEPROM_read_cells(base, line->data, EE_CACHE_LINE);
+	line->tag = uiAddress / EE_CACHE_LINE + 1;
+	return (line->data[uiAddress - base]);
+}
+
+void	ee_cache_store(uint16_t addr, uint8_t data)
+{
+	t_ee_line	*line = ee_cache_line(addr);
+
+	if (line->tag == addr / EE_CACHE_LINE + 1)
+		line->data[addr % EE_CACHE_LINE] = data;
 }
 
+void	ee_cache_report()
+{
+	uart_printstr("EEPROM cache hits : ");
+	uart_printnumber(ee_cache_hits);
+	uart_printstr(", misses : ");
+	uart_printnumber(ee_cache_misses);
+	uart_printstr("\r\n");
+}
+#else
+unsigned char EEPROM_read(unsigned int uiAddress)
+{
+	return (EEPROM_read_cell(uiAddress));
+}
+#endif
+
+// only waits when EEQ_SIZE writes are already pending : that wait needs interrupts on,
+// from a cli() section no more than the free entries can be queued
+void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+{
+	uint8_t	sreg;
+
+	while (eeq_count == EEQ_SIZE)
+	{}
+#if EE_CACHE_LINES
+	ee_cache_store(uiAddress, ucData);
+#endif
+	sreg = SREG;
+	cli();
+	eeq[eeq_head].addr = uiAddress;
+	eeq[eeq_head].data = ucData;
+	eeq_head = (eeq_head + 1) % EEQ_SIZE;
+	eeq_count++;
+	EECR |= (1 << EERIE);
+	SREG = sreg;
+}
+
+
 void	print_eeprom(uint8_t start, uint8_t end)
 {
 	uart_printstr("Line 0 : \r\n");
 	uint8_t	i = start;
 	while (i < end)
 	{
-		EEPROM_read(i);
-		if (EEDR == 0xFF)
+		uint8_t	byte = EEPROM_read(i);
+		if (byte == 0xFF)
 			uart_printstr("_");
 		else
-			uart_printhex(EEDR);
+			uart_printhex(byte);
 		uart_printstr(" ");
 		i++;
 		if (!(i % 32) && i != 0)
@@ -119,9 +372,9 @@ void	print_eeprom(uint8_t start, uint8_t end)
 	}
 }
 
-void	clear_eeprom(uint8_t start, uint8_t end)
+void	clear_eeprom(uint16_t start, uint16_t end)
 {
-	uint8_t	i = start;
+	uint16_t	i = start;
 	while (i < end)
 	{
 		EEPROM_write(i, 0xFF);
@@ -129,667 +382,1019 @@ void	clear_eeprom(uint8_t start, uint8_t end)
 	}
 }
 
-size_t	first_next_byte(size_t index)
+/*********************BLOCK INDEX*************************/
+// block = magic[2] + length[2] + ID[2] (high byte first) + body
+// the EEPROM is walked once at boot (index_build) and every block header goes in a RAM
+// table sorted by address, afterwards finding an id, the block holding an offset or a
+// free spot is a loop over INDEX_SIZE entries in SRAM instead of 2 EEPROM reads per byte
+// a freed block keeps its header with FREE_MAGIC (a tombstone) so the walk can still jump
+// over it, tombstones stay in the table with FREE_ID : that is the free list
+#define EEPROM_SIZE 1024
+#define MOVE_SIZE 9 // block move in progress, see COMPACTION
+#define MOVE_ADDR (EEPROM_SIZE - MOVE_SIZE)
+#define REDO_SIZE 14 // commit in progress, see COMMIT JOURNAL
+#define REDO_ADDR (MOVE_ADDR - REDO_SIZE)
+#define ALLOC_SIZE REDO_ADDR // blocks live below the journals
+#define HEADER_SIZE 6
+#define INDEX_SIZE 32 // 6 bytes of SRAM each
+#define SAFE_ID 0xFFFF // blocks made by safe_eeprom_write, found by offset and not by id
+#define FREE_ID 0xFFFE // tombstones
+#define FREE_MAGIC 0xE1E0 // MAGIC_NUMBER with one bit cleared, freeing is a single byte write
+#define FREE_MAX 255 // body of the tombstones mark_free makes, shrinking one is a single byte write
+#define NO_BLOCK 0xFF
+
+typedef struct	s_block
+{
+	uint16_t	id;
+	uint16_t	start; // address of the magic number
+	uint16_t	length; // body length
+}	t_block;
+
+t_block	blocks[INDEX_SIZE];
+uint8_t	block_count = 0;
+
+uint16_t	EEPROM_read16(uint16_t addr)
+{
+	uint16_t	value = EEPROM_read(addr) << 8;
+	return (value | EEPROM_read(addr + 1));
+}
+
+// only the bytes that changed are written
+void	EEPROM_update(uint16_t addr, uint8_t data)
+{
+	if (EEPROM_read(addr) != data)
+		EEPROM_write(addr, data);
+}
+
+void	EEPROM_update16(uint16_t addr, uint16_t value)
+{
+	EEPROM_update(addr, value >> 8);
+	EEPROM_update(addr + 1, value & 0xFF);
+}
+
+uint16_t	block_end(uint8_t b)
 {
-	uint8_t	mag[2] = {0};
-	int	t = 0;
+	return (blocks[b].start + HEADER_SIZE + blocks[b].length);
+}
+
+uint16_t	block_body(uint8_t b)
+{
+	return (blocks[b].start + HEADER_SIZE);
+}
+
+bool	block_live(uint8_t b)
+{
+	return (blocks[b].id != FREE_ID);
+}
 
-	size_t	tmp = index;
-	while (tmp < 1018)
+// keeps the table sorted by address
+bool	index_insert(uint16_t start, uint16_t id, uint16_t length)
+{
+	uint8_t	i = block_count;
+
+	if (block_count == INDEX_SIZE)
 	{
-		if (tmp == index) // first check ever of mag
-		{
-			EEPROM_read(tmp);
-			mag[0] = EEDR;
-			t = 1;
-		}
-		EEPROM_read(index + t);
-		mag[1] = EEDR;
+		uart_printstr("Block index is full\r\n");
+		return (false);
+	}
+	while (i > 0 && blocks[i - 1].start > start)
+	{
+		blocks[i] = blocks[i - 1];
+		i--;
+	}
+	blocks[i].id = id;
+	blocks[i].start = start;
+	blocks[i].length = length;
+	block_count++;
+	return (true);
+}
+
+void	index_remove(uint8_t b)
+{
+	block_count--;
+	while (b < block_count)
+	{
+		blocks[b] = blocks[b + 1];
+		b++;
+	}
+}
 
+// only place where the EEPROM is scanned byte by byte : the gaps between blocks,
+// a body is skipped as soon as its header is read. With the table full the walk stops :
+// place_block refuses everything, so the blocks above are never overwritten
+void	index_build()
+{
+	uint16_t	addr = 0;
 
-		uint16_t	mag_check = ((mag[0] << 8) | mag[1]);
-		if (mag_check == MAGIC_NUMBER)
+	block_count = 0;
+	while (addr + HEADER_SIZE <= ALLOC_SIZE)
+	{
+		uint16_t	magic = EEPROM_read16(addr);
+		if (magic == MAGIC_NUMBER || magic == FREE_MAGIC)
 		{
-			uart_printstr("Magic number found for first_next_byte\r\n");
-			if (t == 1)
-				return(tmp);
-			else
-				return (tmp - 1);
+			uint16_t	length = EEPROM_read16(addr + 2);
+			if (addr + HEADER_SIZE + length <= ALLOC_SIZE)
+			{
+				if (!index_insert(addr, magic == FREE_MAGIC ? FREE_ID : EEPROM_read16(addr + 4), length))
+				{
+					uart_printstr("index full, blocks from ");
+					uart_printnumber(addr);
+					uart_printstr(" are not indexed\r\n");
+					return ;
+				}
+				addr += HEADER_SIZE + length;
+				continue ;
+			}
 		}
-		tmp++;
-		t = 0;
+		addr++;
 	}
-	return (tmp); // 1019
 }
 
-size_t	find_last_byte(size_t start_of_search)
+uint8_t	index_find(uint16_t id)
 {
-	size_t	index = start_of_search;
-	int		i = (int)start_of_search;
-	int		t = 0;
-	uint8_t	mag[2] = {0};
-	uint8_t	len[2] = {0};
+	uint8_t	i = 0;
 
-	while (i < 1018)
+	while (i < block_count)
 	{
-		/**********************MAGIC CHECK*********************/
-		if (i == 0) // FIRST CHECK INDEX FOR MAGIC
-		{
-			uart_printstr("First magic check\r\n");
-			EEPROM_read(index);
-			mag[0] = EEDR;
-			t = 1;
-		}
-		EEPROM_read(index + t); // new potential mag byte put as second byte
-		mag[1] = EEDR;
-		uint16_t	mag_check = ((mag[0] << 8) | mag[1]);
+		if (blocks[i].id == id)
+			return (i);
+		i++;
+	}
+	return (NO_BLOCK);
+}
 
-		if (mag_check == MAGIC_NUMBER)
-		{
-			/*******************LENGTH CHECK*************************/
-			index++; // now on length bytes
-			EEPROM_read(index);
-			len[0] = EEDR;
-			index++;
-			EEPROM_read(index);
-			len[1] = EEDR;
-			uart_printstr("len[0] = ");
-			uart_printhex(len[0]);
-			uart_printstr("\r\n");
-			uart_printstr("len[1] = ");
-			uart_printhex(len[1]);
-			uart_printstr("\r\n");
-			uint16_t	len_check = ((len[0] << 8) | len[1]);
+uint8_t	index_at(uint16_t start)
+{
+	uint8_t	i = 0;
 
-			uint8_t	last_byte = index + 3 + len_check;
-			return (last_byte);
-		}
+	while (i < block_count)
+	{
+		if (blocks[i].start == start)
+			return (i);
 		i++;
-		index++;
-		t = 0;
 	}
-	return (start_of_search);
+	return (NO_BLOCK);
 }
 
-bool safe_eeprom_read(void *buffer, size_t offset, size_t length)
+// live block whose body holds offset
+uint8_t	index_find_offset(size_t offset)
 {
-	uart_printstr("REAAAAAD\r\n");
-	if ((offset < 6) || (offset > 1018) || (length > 1018)) // impossible address or length
+	uint8_t	i = 0;
+
+	while (i < block_count && blocks[i].start <= offset)
 	{
-		uart_printstr("Impossible address or length for read\r\n");
-		return (false);
+		if (block_live(i) && offset >= block_body(i) && offset < block_end(i))
+			return (i);
+		i++;
 	}
-	int	i = (int)offset - 6;
-	size_t	index = offset - 6;
-	uint8_t	mag[2] = {0};
-	uint8_t	len[2] = {0};
-	int	t = 0;
+	return (NO_BLOCK);
+}
+
+// free run (tombstones and never written bytes) around [start, end),
+// false if a live block is in the way
+bool	free_run(uint16_t start, uint16_t end, uint16_t *run_start, uint16_t *run_end)
+{
+	uint8_t	i = 0;
 
-	while (i >= 0)
+	*run_start = 0;
+	*run_end = ALLOC_SIZE;
+	while (i < block_count)
 	{
-		/**********************MAGIC CHECK*********************/
-		if (index == (offset - 6)) // FIRST CHECK INDEX FOR MAGIC
+		if (block_live(i))
 		{
-			uart_printstr("First magic check\r\n");
-			// EEPROM_read(index);
-			// mag[1] = EEDR;
-			t = 1;
-		}
-		if (t == 1)
-		{
-			EEPROM_read(index + 1);
-			mag[0] = EEDR;
-		}
-		if (t == 0)
-		{
-			mag[0] = mag[1];
+			if (start < block_end(i) && blocks[i].start < end)
+				return (false);
+			if (block_end(i) <= start)
+				*run_start = block_end(i);
+			else if (blocks[i].start < *run_end)
+				*run_end = blocks[i].start;
 		}
-		EEPROM_read(index);
-		mag[1] = EEDR; // new potential mag byte put as second byte
-
-		// uart_printstr("mag[1] = ");
-		// uart_printhex(mag[1]);
-		// uart_printstr("\r\n");
-		// uart_printstr("mag[0] = ");
-		// uart_printhex(mag[0]);
-		// uart_printstr("\r\n");
-		uint16_t	mag_check = ((mag[1] << 8) | mag[0]);
-		if (mag_check == MAGIC_NUMBER)
-		{
-			uart_printstr("Magic number found\r\n");
-			/*******************LENGTH CHECK*************************/
-			// if (t == 0)
-			// 	index++;
-			index += 2; // now on length bytes
-			EEPROM_read(index);
-			len[0] = EEDR;
-			index++;
-			EEPROM_read(index);
-			len[1] = EEDR;
-			uart_printstr("len[0] = ");
-			uart_printhex(len[0]);
-			uart_printstr("\r\n");
-			uart_printstr("len[1] = ");
-			uart_printhex(len[1]);
-			uart_printstr("\r\n");
-			uint16_t	len_check = ((len[0] << 8) | len[1]);
+		i++;
+	}
+	return (end <= ALLOC_SIZE);
+}
 
-			size_t	taken_length = offset - index - 3;
-			size_t	available_length = len_check - taken_length; // available length in already written block
+// best fit : the smallest free run that holds header + length, ALLOC_SIZE if none does
+size_t	find_free_spot(uint16_t length)
+{
+	uint16_t	need = HEADER_SIZE + length;
+	uint16_t	prev_end = 0;
+	uint16_t	best = ALLOC_SIZE;
+	uint16_t	best_size = 0xFFFF;
+	uint8_t		i = 0;
 
-			size_t	last_byte = index + 3 + len_check;
-			// begin check
-			if (offset > last_byte)
-			{
-				uart_printstr("Offset out of MY data range\r\n");
-				return (false);
-			}
-			// end of read check
-			if (length > available_length)
+	while (i <= block_count)
+	{
+		uint16_t	next = (i < block_count) ? blocks[i].start : ALLOC_SIZE;
+		if (i == block_count || block_live(i))
+		{
+			if (next - prev_end >= need && next - prev_end < best_size)
 			{
-				uart_printstr("Length of data to read goes after MY data range\r\n");
-				return (false);
+				best = prev_end;
+				best_size = next - prev_end;
 			}
+			if (i < block_count)
+				prev_end = block_end(i);
+		}
+		i++;
+	}
+	return (best);
+}
 
-			index += 3; // go from second length index to first body byte by skipping ID
-			// so at data block of already written data
+// for a header index_build can't reach yet (or over erased bytes) : the magic goes last
+void	write_header(uint16_t start, uint16_t magic, uint16_t id, uint16_t length)
+{
+	EEPROM_update16(start + 4, id);
+	EEPROM_update16(start + 2, length);
+	EEPROM_update16(start, magic);
+}
 
-			index = offset;
-			size_t	body_count = 0;
-			while (body_count < length)
-			{
-				EEPROM_read(index);
-				*((uint8_t*)buffer + body_count) = EEDR;
-				uart_printstr("Read once at index :");
-				uart_printhex(index);
-				uart_printstr(" = ");
-				uart_printhex(EEDR);
-				uart_printstr("\r\n");
-				body_count++;
-				index++;
-			}
-			*((uint8_t*)buffer + body_count) = '\0';
-			uart_printstr("Successfully read\r\n");
-			return (true);
-		}
-		index--;
-		i--;
-		t = 0;
+/*********************COMMIT JOURNAL*************************/
+// index_build trusts the first header it meets in a free run and jumps over its length,
+// a header cut by a reset (magic there, length half written) sends it in the middle of
+// other blocks. place_block first makes one tombstone cover the free run up to the first
+// tombstone past the new block, writes everything it can under it where the walk can't
+// see it (trailing tombstone, body, new header), then shows it with a few header bytes :
+// the commit.
+// A single byte is atomic, more go through the redo journal first and are copied again
+// by redo_recover at boot if the reset came in between. A cut record is ignored, the
+// commit just never happened.
+// redo = addr[2] (high byte first, written last) + count + data[count], 0xFF when idle
+#define REDO_MAX (REDO_SIZE - 3)
+
+// copies the record in place, then closes it
+void	redo_apply()
+{
+	uint16_t	addr = EEPROM_read16(REDO_ADDR);
+	uint8_t		count = EEPROM_read(REDO_ADDR + 2);
+	uint8_t		i = 0;
+
+	while (i < count && i < REDO_MAX)
+	{
+		EEPROM_update(addr + i, EEPROM_read(REDO_ADDR + 3 + i));
+		i++;
 	}
-	uart_printstr("Not my magic number\r\n");
-	return (false);
+	EEPROM_update(REDO_ADDR, 0xFF);
 }
 
-bool safe_eeprom_write(void * buffer, size_t offset, size_t length)
+// all of data lands at addr or none of it, only the span that changes is journaled
+void	commit_write(uint16_t addr, uint8_t *data, uint8_t count)
 {
-	uint8_t	mag[2] = {0};
-	uint8_t	len[2] = {0};
-	uint8_t	*tmp = (uint8_t*)buffer;
-	int	t = 0;
+	uint8_t	i = 0;
 
-	uart_printstr("WRIIIITE\r\n");
-	if ((offset < 6) || (offset > 1018) || (length > 1018)) // impossible address or length
+	while (count && EEPROM_read(addr) == data[0])
 	{
-		uart_printstr("Impossible address or length for write\r\n");
-		return (false);
+		addr++;
+		data++;
+		count--;
 	}
-	
-	size_t	index = offset - 6; // magic[2] + length[2] + ID[2]
-	int	i = (int)offset - 6;
-	while (i >= 0)
+	while (count && EEPROM_read(addr + count - 1) == data[count - 1])
+		count--;
+	if (count <= 1)
 	{
-		/**********************MAGIC CHECK*********************/
-		if (index == (offset - 6)) // FIRST CHECK INDEX FOR MAGIC
-		{
-			uart_printstr("First magic check\r\n");
-			// EEPROM_read(index);
-			// mag[1] = EEDR;
-			t = 1;
-		}
-		if (t == 1)
-		{
-			EEPROM_read(index + 1);
-			mag[0] = EEDR;
-		}
-		if (t == 0)
-		{
-			mag[0] = mag[1];
-		}
-		EEPROM_read(index); // new potential mag byte put as second byte
-		mag[1] = EEDR;
-		uint16_t	mag_check = ((mag[1] << 8) | mag[0]);
+		if (count)
+			EEPROM_write(addr, data[0]);
+		return ;
+	}
+	while (i < count)
+	{
+		EEPROM_update(REDO_ADDR + 3 + i, data[i]);
+		i++;
+	}
+	EEPROM_update(REDO_ADDR + 2, count);
+	EEPROM_update(REDO_ADDR + 1, addr & 0xFF);
+	EEPROM_update(REDO_ADDR, addr >> 8); // last, the record is complete
+	redo_apply();
+}
 
-		if (mag_check == MAGIC_NUMBER)
-		{
-			uart_printstr("Magic number found\r\n");
-			// if (t == 1)
-			// 	index++;
-			/*******************LENGTH CHECK*************************/
-			index += 2; // now on length bytes
-			EEPROM_read(index);
-			len[0] = EEDR;
-			index++;
-			EEPROM_read(index);
-			len[1] = EEDR;
-			uart_printstr("len[0] = ");
-			uart_printhex(len[0]);
-			uart_printstr("\r\n");
-			uart_printstr("len[1] = ");
-			uart_printhex(len[1]);
-			uart_printstr("\r\n");
-			uint16_t	len_check = ((len[0] << 8) | len[1]);
+// at boot, first thing : an address above the EEPROM is the idle 0xFF
+void	redo_recover()
+{
+	if (EEPROM_read(REDO_ADDR) >= (EEPROM_SIZE >> 8))
+		return ;
+	uart_printstr("Finishing an interrupted commit\r\n");
+	redo_apply();
+}
 
-			size_t	taken_length = offset - index - 3;
-			size_t	available_length = len_check - taken_length; // available length of already written data by me
+// one tombstone from run_start to run_end, what is inside the run is out of sight
+// the id of a tombstone is never read, only magic and length have to be right
+void	cover_run(uint16_t run_start, uint16_t run_end)
+{
+	uint16_t	length = run_end - run_start - HEADER_SIZE;
+	uint8_t		cover[4] = {FREE_MAGIC >> 8, FREE_MAGIC & 0xFF, length >> 8, length & 0xFF};
 
-			size_t	last_byte = index + 3 + len_check;
-			// if data will go above 1023
-			if ((offset - 6) > 1018)
-			{
-				uart_printstr("Start of data goes above the max memory\r\n");
-				return (false);
-			}
-			if ((offset + length) > 1023)
-			{
-				uart_printstr("Data to write goes above the max memory\r\n");
-				return (false);
-			}
-			if ((offset - 6) > last_byte)
-			{
-				break; // we can write fresh new data
-			}
-			// in my range but too large
-			if ((offset < last_byte) && (length > available_length))
-			{
-				uart_printstr("Length is too large to write in MY data range\r\n");
-				return (false);
-			}
-			/*************************ID PART***********************************/
-			index++; // now on Id byte
-			index++;
-
-			/*****************BODY PART******************/
-			index++; // now on first body byte of already written data
-
-			uart_printstr("Offset is in MY range and I have enough space to write\r\n");
-			index = offset;
-			size_t	body_count = 0;
-			// see if anything identical would be replaced
-			while (body_count < length)
-			{
-				EEPROM_read(index);
-				uart_printstr("EEDR read = ");
-				uart_printhex(EEDR);
-				uart_printstr("\r\n");
-				uart_printstr("buffer[i] = ");
-				uart_printhex(tmp[body_count]);
-				uart_printstr("\r\n");
-				if (EEDR != tmp[body_count])
-				{
-					uart_printstr("Not identical\r\n");
-					EEPROM_write(index, tmp[body_count]);
-				}
-				body_count++;
-				index++;
-			}
-			uart_printstr("Wrote before but replaced only non identical bytes\r\n");
-			return (true);
-		}
-		index--;
-		i--;
-		t = 0;
+	commit_write(run_start, cover, 4);
+}
+
+// tombstones of [start, end) are going to be overwritten
+void	index_drop_free(uint16_t start, uint16_t end)
+{
+	uint8_t	i = 0;
+
+	while (i < block_count)
+	{
+		if (!block_live(i) && blocks[i].start < end && block_end(i) > start)
+			index_remove(i);
+		else
+			i++;
 	}
-	/**********************I DID NOT WRITE BEFORE*********************/
+}
+
+// tombstones mark_free makes for [start, end)
+uint8_t	free_links(uint16_t start, uint16_t end)
+{
+	if (end - start < HEADER_SIZE)
+		return (0);
+	if (end - start >= 2 * HEADER_SIZE + FREE_MAX)
+		return (2);
+	return (1);
+}
+
+// [start, end) becomes a tombstone, or is erased if it can't even hold a header
+// (a stale header there would fool index_build). A long run is cut after FREE_MAX bytes :
+// the first tombstone is the one place_block shrinks, by one length byte. The second
+// one is written first, the first header shows up once the one it jumps to is there
+void	mark_free(uint16_t start, uint16_t end)
+{
+	uint16_t	link = start + HEADER_SIZE + FREE_MAX;
 
-	/******************CHECK IF WE CROSS NEXT MAGIC BLOCK*********************/
-	size_t	next_byte = first_next_byte(offset);
-	if ((offset + length) >= next_byte)
+	index_drop_free(start, end);
+	if (free_links(start, end) == 2)
 	{
-		uart_printstr("Data comes across another of MY data blocks\r\n");
-		return (false);
+		write_header(link, FREE_MAGIC, FREE_ID, end - link - HEADER_SIZE);
+		index_insert(link, FREE_ID, end - link - HEADER_SIZE);
+		end = link;
+	}
+	if (end - start >= HEADER_SIZE)
+	{
+		write_header(start, FREE_MAGIC, FREE_ID, end - start - HEADER_SIZE);
+		index_insert(start, FREE_ID, end - start - HEADER_SIZE);
+		return ;
 	}
+	while (start < end)
+	{
+		EEPROM_update(start, 0xFF);
+		start++;
+	}
+}
 
-	/*************SET MAGIC****************/
-	index = offset - 6;
-	uint8_t	new_mag_tab[2];
-	new_mag_tab[1] = ((MAGIC_NUMBER & 0xFF00) >> 8);
-	EEPROM_write(index, new_mag_tab[1]);
-	index++;
-	new_mag_tab[0] = (MAGIC_NUMBER & 0x00FF);
-	EEPROM_write(index, new_mag_tab[0]);
-
-	/*************SET LENGTH****************/
-	index++;
-	uint8_t	new_length_tab[2];
-	new_length_tab[1] = ((length & 0xFF00) >> 8);
-	EEPROM_write(index, new_length_tab[1]);
-	index++;
-	new_length_tab[0] = (length & 0x00FF);
-	EEPROM_write(index, new_length_tab[0]);
-
-
-	/*************SET ID****************/
-	index++;
-	uint16_t	new_id = 1;
-	uint8_t	new_id_tab[2];
-	new_id_tab[1] = ((new_id & 0xFF00) >> 8);
-	EEPROM_write(index, new_id_tab[1]);
-	index++;
-	new_id_tab[0] = (new_id & 0x00FF);
-	EEPROM_write(index, new_id_tab[0]);
-	index++;
-
-	size_t	body_count = 0;
-	while (body_count < length)
-	{
-		EEPROM_write(index, tmp[body_count]);
-		body_count++;
-		index++;
+void	write_body(uint16_t addr, uint8_t *data, size_t length)
+{
+	size_t	i = 0;
+
+	while (i < length)
+	{
+		EEPROM_update(addr + i, data[i]);
+		i++;
 	}
-	uart_printstr("Never wrote before and succesfully wrote a fresh nw block and its headers\r\n");
-	return (true); // no existant data written by me found before
 }
 
-size_t	find_free_spot(uint16_t length)
+void	read_body(uint16_t addr, uint8_t *data, size_t length)
 {
-	size_t	index = 0;
-	size_t	last_byte = 0;
-	size_t	first_byte = 0;
+	size_t	i = 0;
 
-	while (first_byte < 1018)
+	while (i < length)
 	{
-		if (index == 0)
-			last_byte = find_last_byte(0);
-		first_byte = first_next_byte(last_byte);
-		size_t	check = first_byte - last_byte;
-		if (check <= length)
-			return(last_byte);
-		else
-			last_byte = find_last_byte(first_byte);
+		data[i] = EEPROM_read(addr + i);
+		i++;
 	}
-	return (first_byte);
+	data[i] = '\0';
 }
 
-bool eepromalloc_free(uint16_t id);
+// first place at or after end where the walk can land : a tombstone or the end of the run
+uint16_t	run_landing(uint16_t end, uint16_t run_end)
+{
+	uint16_t	land = run_end;
+	uint8_t		i = 0;
 
-bool eepromalloc_read(uint16_t id, void *buffer, uint16_t length)
+	while (i < block_count)
+	{
+		if (!block_live(i) && blocks[i].start >= end && blocks[i].start < land)
+			land = blocks[i].start;
+		i++;
+	}
+	return (land);
+}
+
+// enough index entries for a new block ending at end once the tombstones of
+// [run_start, run_end) are merged : at most one in front of it, free_links after it
+bool	index_room(uint16_t run_start, uint16_t run_end, uint16_t end)
+{
+	uint8_t	n = block_count + 2 + free_links(end, run_end);
+	uint8_t	i = 0;
+
+	while (i < block_count)
+	{
+		if (!block_live(i) && blocks[i].start >= run_start && blocks[i].start < run_end)
+			n--;
+		i++;
+	}
+	return (n <= INDEX_SIZE);
+}
+
+// new block at start, inside a free run : what is left of the run on both sides is
+// turned back into tombstones. Everything is written under the cover of the run, then the
+// block shows up as a tombstone (the commit) and goes live with one byte, the reverse
+// of eepromalloc_free. A reset anywhere leaves either the old run or the new block.
+bool	place_block(uint16_t start, uint16_t id, uint8_t *data, uint16_t length)
 {
-	uart_printstr("REAAAAAD\r\n");
-	if (length > 1018) // impossible address or length
+	uint16_t	run_start;
+	uint16_t	run_end;
+	uint16_t	end = start + HEADER_SIZE + length;
+	uint16_t	gap;
+	uint8_t		head[REDO_MAX];
+	uint8_t		i = 0;
+
+	if (!free_run(start, end, &run_start, &run_end))
+		return (false);
+	// the cover only has to hide the new block and what follows it up to a landing : most
+	// of the time the tombstone already at run_start does, and the commit is one length byte.
+	// The whole run is merged when the index needs the entries of its tombstones back
+	if (index_room(run_start, run_landing(end, run_end), end))
+		run_end = run_landing(end, run_end);
+	else if (!index_room(run_start, run_end, end))
 	{
-		uart_printstr("Impossible length for read\r\n");
+		uart_printstr("Block index is full\r\n");
 		return (false);
 	}
-	uint8_t	mag[2] = {0};
-	uint8_t	len[2] = {0};
-	uint8_t	idd[2] = {0};
-	int	t = 0;
+	gap = start - run_start;
+	index_drop_free(run_start, run_end);
+	cover_run(run_start, run_end);
+	mark_free(end, run_end);
+	write_body(start + HEADER_SIZE, data, length);
+	EEPROM_update16(start + 4, id); // a tombstone has no id, safe even on the cover header
+	if (gap >= HEADER_SIZE)
+	{
+		write_header(start, FREE_MAGIC, id, length);
+		head[0] = (gap - HEADER_SIZE) >> 8;
+		head[1] = (gap - HEADER_SIZE) & 0xFF;
+		commit_write(run_start + 2, head, 2); // the cover now stops at start
+		index_insert(run_start, FREE_ID, gap - HEADER_SIZE);
+	}
+	else
+	{
+		// the new header overlaps the cover one, erased bytes in front of it
+		while (i < gap)
+			head[i++] = 0xFF;
+		head[i++] = FREE_MAGIC >> 8;
+		head[i++] = FREE_MAGIC & 0xFF;
+		head[i++] = length >> 8;
+		head[i++] = length & 0xFF;
+		head[i++] = id >> 8;
+		head[i++] = id & 0xFF;
+		commit_write(run_start, head, i);
+	}
+	EEPROM_update(start + 1, MAGIC_NUMBER & 0xFF);
+	index_insert(start, id, length);
+	return (true);
+}
 
-	size_t	index = 0;
-	int	i = 0;
+/*********************COMPACTION*************************/
+// idle time defragmentation : compact_step() moves the first live block that has at least
+// COMPACT_MIN_GAP free bytes below it down by at most COMPACT_STEP bytes per call.
+// The move is copied low to high in chunks of (src - dst) bytes, a chunk only
+// overwrites source bytes of the chunks already copied, so after a reset the move is
+// resumed from the last finished chunk written in the journal :
+// journal = MOVE_MAGIC, src, dst, size, done (high byte first), 0xFF when idle
+// done changes during the move and goes through commit_write, a reset can't leave it
+// with one new byte and one old one
+// Blocks of safe_eeprom_write are never moved, their offset is their name.
+// done is committed after every chunk : a small gap means a commit every few bytes on the
+// same journal cells, smaller gaps are left until a neighbour is freed and widens them
+// a call only queues its writes (EEPROM WRITE QUEUE), it waits when the queue is full
+#define COMPACT_STEP 4
+#define COMPACT_MIN_GAP 16
+#define MOVE_MAGIC 0xC5
+
+typedef struct	s_move
+{
+	uint8_t		active;
+	uint16_t	src;
+	uint16_t	dst;
+	uint16_t	size; // header + body
+	uint16_t	done; // last finished chunk, also in the journal
+	uint16_t	pos; // bytes copied
+}	t_move;
+
+t_move	move = {0, 0, 0, 0, 0, 0};
+
+// first live block with a hole of COMPACT_MIN_GAP bytes or more below it
+bool	compact_plan()
+{
+	uint16_t	prev_end = 0;
+	uint8_t		i = 0;
 
-	while (i < 1018)
+	while (i < block_count)
 	{
-		/**********************MAGIC CHECK*********************/
-		if (i == 0) // FIRST CHECK INDEX FOR MAGIC
+		if (block_live(i))
 		{
-			uart_printstr("First magic check\r\n");
-			EEPROM_read(index);
-			mag[0] = EEDR;
-			t = 1;
+			if (blocks[i].start >= prev_end + COMPACT_MIN_GAP && blocks[i].id != SAFE_ID)
+				break ;
+			prev_end = block_end(i);
 		}
-		EEPROM_read(index + t); // new potential mag byte put as second byte
-		mag[1] = EEDR;
-		uint16_t	mag_check = ((mag[0] << 8) | mag[1]);
+		i++;
+	}
+	if (i == block_count)
+		return (false);
+	move.src = blocks[i].start;
+	move.dst = prev_end;
+	move.size = HEADER_SIZE + blocks[i].length;
+	move.done = 0;
+	move.pos = 0;
+	index_drop_free(move.dst, move.src);
+	EEPROM_update16(MOVE_ADDR + 1, move.src);
+	EEPROM_update16(MOVE_ADDR + 3, move.dst);
+	EEPROM_update16(MOVE_ADDR + 5, move.size);
+	EEPROM_update16(MOVE_ADDR + 7, move.done);
+	EEPROM_update(MOVE_ADDR, MOVE_MAGIC); // last, the entry is complete
+	move.active = 1;
+	return (true);
+}
+
+// the block now starts at dst, what it left above becomes free
+void	move_finish()
+{
+	uint8_t	b = index_at(move.src);
+
+	if (b != NO_BLOCK)
+		blocks[b].start = move.dst;
+	mark_free(move.dst + move.size, move.src + move.size);
+	EEPROM_update(MOVE_ADDR, 0xFF);
+	move.active = 0;
+}
+
+void	move_copy(uint16_t budget)
+{
+	uint8_t	done[2];
 
-		/*****************************MAGIC NUMBER FOUND**********************************/
-		if (mag_check == MAGIC_NUMBER)
+	while (budget && move.pos < move.size)
+	{
+		EEPROM_update(move.dst + move.pos, EEPROM_read(move.src + move.pos));
+		move.pos++;
+		if (move.pos == move.size || move.pos - move.done == move.src - move.dst)
 		{
-			uart_printstr("Magic number found\r\n");
-			if (t == 1)
-				index++;
-			index += 3; // skip length bytes to reach Id bytes
-			EEPROM_read(index);
-			idd[0] = EEDR;
-			index++;
-			EEPROM_read(index);
-			idd[1] = EEDR;
-			uart_printstr("id[0] = ");
-			uart_printhex(idd[0]);
-			uart_printstr("\r\n");
-			uart_printstr("id[1] = ");
-			uart_printhex(idd[1]);
-			uart_printstr("\r\n");
-			uint16_t	id_check = ((idd[0] << 8) | idd[1]);
-			if (id_check == id)
-			{
-				/********************ID HAS BEEN FOUND************************/
-				uart_printstr("Id found\r\n");
-
-				index -= 4; // now on length bytes
-				EEPROM_read(index);
-				len[0] = EEDR;
-				index++;
-				EEPROM_read(index);
-				len[1] = EEDR;
-				uart_printstr("len[0] = ");
-				uart_printhex(len[0]);
-				uart_printstr("\r\n");
-				uart_printstr("len[1] = ");
-				uart_printhex(len[1]);
-				uart_printstr("\r\n");
-				uint16_t	len_check = ((len[0] << 8) | len[1]);
-
-				if (length > len_check)
-				{
-					uart_printstr("Length of data to read goes after MY data range\r\n");
-					return (false);
-				}
+			move.done = move.pos;
+			done[0] = move.done >> 8;
+			done[1] = move.done & 0xFF;
+			commit_write(MOVE_ADDR + 7, done, 2);
+		}
+		budget--;
+	}
+	if (move.pos == move.size)
+		move_finish();
+}
 
-				index += 5; // now on body part (skip length + id)
-				size_t	body_count = 0;
-				while (body_count < length)
-				{
-					EEPROM_read(index);
-					*((uint8_t*)buffer + body_count) = EEDR;
-					uart_printstr("Read once at index :");
-					uart_printhex(index);
-					uart_printstr(" = ");
-					uart_printhex(EEDR);
-					uart_printstr("\r\n");
-					body_count++;
-					index++;
-				}
-				*((uint8_t*)buffer + body_count) = '\0';
-				uart_printstr("Successfully read data on asked id\r\n");
-				return (true);
-			}
+// false once there is nothing left to move
+bool	compact_step()
+{
+	if (!move.active && !compact_plan())
+		return (false);
+	move_copy(COMPACT_STEP);
+	return (true);
+}
+
+// the API never works on a half moved block
+void	compact_finish()
+{
+	if (move.active)
+		move_copy(move.size);
+}
+
+// at boot, after redo_recover (done is whole again) and before index_build :
+// a move cut by a reset is finished first
+void	compact_recover()
+{
+	if (EEPROM_read(MOVE_ADDR) != MOVE_MAGIC)
+		return ;
+	move.src = EEPROM_read16(MOVE_ADDR + 1);
+	move.dst = EEPROM_read16(MOVE_ADDR + 3);
+	move.size = EEPROM_read16(MOVE_ADDR + 5);
+	move.done = EEPROM_read16(MOVE_ADDR + 7);
+	move.pos = move.done;
+	move.active = 1;
+	uart_printstr("Finishing an interrupted block move\r\n");
+	block_count = 0;
+	move_copy(move.size);
+}
+
+void	alloc_init()
+{
+	redo_recover();
+	compact_recover();
+	index_build();
+}
+
+/*********************OFFSET API*************************/
+bool safe_eeprom_read(void *buffer, size_t offset, size_t length)
+{
+	if ((offset < HEADER_SIZE) || (offset >= ALLOC_SIZE) || (length > ALLOC_SIZE)) // impossible address or length
+	{
+		uart_printstr("Impossible address or length for read\r\n");
+		return (false);
+	}
+	compact_finish();
+	uint8_t	b = index_find_offset(offset);
+	if (b == NO_BLOCK)
+	{
+		uart_printstr("Not my magic number\r\n");
+		return (false);
+	}
+	if (offset + length > block_end(b))
+	{
+		uart_printstr("Length of data to read goes after MY data range\r\n");
+		return (false);
+	}
+	read_body(offset, buffer, length);
+	uart_printstr("Successfully read\r\n");
+	return (true);
+}
+
+bool safe_eeprom_write(void * buffer, size_t offset, size_t length)
+{
+	if ((offset < HEADER_SIZE) || (offset >= ALLOC_SIZE) || (offset + length > ALLOC_SIZE)) // impossible address or length
+	{
+		uart_printstr("Impossible address or length for write\r\n");
+		return (false);
+	}
+	compact_finish();
+	uint8_t	b = index_find_offset(offset);
+	if (b != NO_BLOCK)
+	{
+		if (offset + length > block_end(b))
+		{
+			uart_printstr("Length is too large to write in MY data range\r\n");
+			return (false);
 		}
-		index++;
-		i++;
-		t = 0;
+		write_body(offset, buffer, length);
+		uart_printstr("Wrote before but replaced only non identical bytes\r\n");
+		return (true);
 	}
-	uart_printstr("Id does not exist\r\n");
-	return (false);
+	/**********************I DID NOT WRITE BEFORE*********************/
+	if (!place_block(offset - HEADER_SIZE, SAFE_ID, buffer, length))
+	{
+		uart_printstr("Data comes across another of MY data blocks\r\n");
+		return (false);
+	}
+	uart_printstr("Never wrote before and succesfully wrote a fresh nw block and its headers\r\n");
+	return (true); // no existant data written by me found before
 }
 
-uint16_t	find_id(uint16_t *ids)
+/*********************ID API*************************/
+bool eepromalloc_free(uint16_t id)
 {
-	int			i = 0;
-	uint16_t	new = 0;
+	compact_finish();
+	uint8_t	b = index_find(id);
 
-	while (ids)
+	if (id >= FREE_ID || b == NO_BLOCK)
 	{
-		if (ids[i] != new)
-			return (new);
-		i++;
-		new++;
+		uart_printstr("Id does not exist\r\n");
+		return (false);
 	}
-	return (-1);
+	EEPROM_update(blocks[b].start + 1, FREE_MAGIC & 0xFF);
+	blocks[b].id = FREE_ID;
+	uart_printstr("Freed id\r\n");
+	return (true);
 }
 
+bool eepromalloc_read(uint16_t id, void *buffer, uint16_t length)
+{
+	compact_finish();
+	uint8_t	b = index_find(id);
+
+	if (id >= FREE_ID || b == NO_BLOCK)
+	{
+		uart_printstr("Id does not exist\r\n");
+		return (false);
+	}
+	if (length > blocks[b].length)
+	{
+		uart_printstr("Length of data to read goes after MY data range\r\n");
+		return (false);
+	}
+	read_body(block_body(b), buffer, length);
+	uart_printstr("Successfully read data on asked id\r\n");
+	return (true);
+}
 
 bool eepromalloc_write(uint16_t id, void *buffer, uint16_t length)
 {
-	uint8_t	mag[2] = {0};
-	uint8_t	len[2] = {0};
-	uint8_t	idd[2] = {0};
-	uint8_t	*tmp = (uint8_t*)buffer;
-	int	t = 0;
-	uint16_t	ids[146]; // 1024 / 7 ~= 146 possible blocks of data
-	int	j = 0;
-
-	if (length > 1018) // impossible address or length
+	if (id >= FREE_ID || length > ALLOC_SIZE - HEADER_SIZE) // impossible id or length
 	{
-		uart_printstr("Impossible length for write\r\n");
+		uart_printstr("Impossible id or length for write\r\n");
 		return (false);
 	}
-	
-	size_t	index = 0;
-	int	i = 0;
-	while (i < 1018)
+	compact_finish();
+	uint8_t	b = index_find(id);
+	if (b != NO_BLOCK)
 	{
-		/**********************MAGIC CHECK*********************/
-		if (i == 0) // FIRST CHECK INDEX FOR MAGIC
+		if (length > blocks[b].length)
 		{
-			uart_printstr("First magic check\r\n");
-			EEPROM_read(index);
-			mag[0] = EEDR;
-			t = 1;
+			uart_printstr("Length of data is too long to write for this id\r\n");
+			return (false);
 		}
-		EEPROM_read(index + t); // new potential mag byte put as second byte
-		mag[1] = EEDR;
-		uint16_t	mag_check = ((mag[0] << 8) | mag[1]);
+		write_body(block_body(b), buffer, length);
+		uart_printstr("Id found, replaced only non identical bytes\r\n");
+		return (true);
+	}
+	/**********************NO ID HAS BEEN FOUND*********************/
+	size_t	start = find_free_spot(length);
+	if (start >= ALLOC_SIZE || !place_block(start, id, buffer, length))
+	{
+		uart_printstr("ERROR : could not find any free spot in the memory\r\n");
+		return (false);
+	}
+	uart_printstr("Succesfully wrote a fresh new block and its headers in a free spot\r\n");
+	return (true);
+}
+
+#ifdef ALLOC_BENCH
+/*********************BENCHMARK*************************/
+// run it under simavr : the old lookup walked the EEPROM with 2 reads per byte until
+// the magic number and the id matched, the index walks the RAM table
+#define BENCH_BLOCKS 24
+#define BENCH_LOOKUPS 16
+
+uint16_t	scan_find(uint16_t id)
+{
+	uint16_t	addr = 0;
+
+	while (addr + HEADER_SIZE <= EEPROM_SIZE)
+	{
+		if (EEPROM_read(addr) == (MAGIC_NUMBER >> 8) && EEPROM_read(addr + 1) == (MAGIC_NUMBER & 0xFF)
+			&& EEPROM_read16(addr + 4) == id)
+			return (addr);
+		addr++;
+	}
+	return (EEPROM_SIZE);
+}
+
+// doc 16.11.2 : timer1 normal mode, prescaler 64 -> 4 us per tick
+void	alloc_bench()
+{
+	uint8_t		body[16] = "bench data 0123";
+	uint16_t	i = 0;
+	uint16_t	t;
+	uint16_t	found = 0;
+
+	clear_eeprom(0, ALLOC_SIZE);
+	index_build();
+	uart_printstr("Filling the EEPROM...\r\n");
+	while (i < BENCH_BLOCKS)
+	{
+		eepromalloc_write(i, body, sizeof(body));
+		i++;
+	}
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11) | (1 << CS10);
+
+	TCNT1 = 0;
+	i = 0;
+	while (i < BENCH_LOOKUPS)
+		found += scan_find(BENCH_BLOCKS - 1 - (i++ % 4)) != EEPROM_SIZE;
+	t = TCNT1;
+	uart_printstr("EEPROM scan lookups, us : ");
+	uart_printnumber((uint32_t)t * 4);
+	uart_printstr("\r\n");
+
+	TCNT1 = 0;
+	i = 0;
+	while (i < BENCH_LOOKUPS)
+		found += index_find(BENCH_BLOCKS - 1 - (i++ % 4)) != NO_BLOCK;
+	t = TCNT1;
+	uart_printstr("RAM index lookups, us : ");
+	uart_printnumber((uint32_t)t * 4);
+	uart_printstr("\r\nfound : ");
+	uart_printnumber(found);
+	uart_printstr("\r\n");
+
+	TCNT1 = 0;
+	index_build();
+	t = TCNT1;
+	uart_printstr("index_build at boot, us : ");
+	uart_printnumber((uint32_t)t * 4);
+	uart_printstr("\r\n");
+}
+#endif
+
+#if defined(COMMIT_BENCH) || defined(CACHE_BENCH)
+uint16_t	bench_seed = 5;
+
+// xorshift : the same session at every run
+uint16_t	bench_rand()
+{
+	bench_seed ^= bench_seed << 7;
+	bench_seed ^= bench_seed >> 9;
+	bench_seed ^= bench_seed << 8;
+	return (bench_seed);
+}
+#endif
+
+#ifdef COMMIT_BENCH
+/*********************COMMIT BENCHMARK*************************/
+// make DEFS=-DCOMMIT_BENCH : bytes programmed per new block (from eeq_stats, skipped bytes
+// are not counted) over a random alloc / free / compact session with small bodies, where
+// the fixed cost of place_block (cover, trailing tombstone, commit) weighs the most
+#define COMMIT_BENCH_IDS 40
+#define COMMIT_BENCH_ROUNDS 1000
+#ifndef COMMIT_BENCH_LEN
+# define COMMIT_BENCH_LEN 10 // bodies of 1 to COMMIT_BENCH_LEN bytes
+#endif
+
+// the counters are 16 bits, a difference of two calls is still right
+uint16_t	eeq_programmed()
+{
+	EEPROM_flush();
+	return (eeq_stats.atomic + eeq_stats.erase + eeq_stats.write);
+}
 
-		if (mag_check == MAGIC_NUMBER)
+void	commit_bench()
+{
+	uint8_t		live[COMMIT_BENCH_IDS];
+	uint8_t		body[COMMIT_BENCH_LEN];
+	uint16_t	round = 0;
+	uint16_t	allocs = 0;
+	uint32_t	bytes = 0;
+	uint16_t	before;
+	uint8_t		id;
+	uint8_t		i = 0;
+
+	clear_eeprom(0, ALLOC_SIZE);
+	index_build();
+	while (i < COMMIT_BENCH_IDS)
+		live[i++] = 0;
+	while (round < COMMIT_BENCH_ROUNDS)
+	{
+		id = bench_rand() % COMMIT_BENCH_IDS;
+		if (!live[id])
 		{
-			uart_printstr("Magic number found\r\n");
-			if (t == 1)
-				index++;
-			index += 3; // skip length bytes to reach Id bytes
-			EEPROM_read(index);
-			idd[0] = EEDR;
-			index++;
-			EEPROM_read(index);
-			idd[1] = EEDR;
-			uart_printstr("id[0] = ");
-			uart_printhex(idd[0]);
-			uart_printstr("\r\n");
-			uart_printstr("id[1] = ");
-			uart_printhex(idd[1]);
-			uart_printstr("\r\n");
-			uint16_t	id_check = ((idd[0] << 8) | idd[1]);
-			/***************ADD ENCOUNTERED ID**************/
-			ids[j] = id_check;
-			j++;
-			if (id_check == id)
+			i = 0;
+			while (i < COMMIT_BENCH_LEN)
+				body[i++] = bench_rand();
+			before = eeq_programmed();
+			live[id] = eepromalloc_write(id, body, 1 + bench_rand() % COMMIT_BENCH_LEN);
+			if (live[id])
 			{
-				/************************ID HAS BEEN FOUND**************************/
-				uart_printstr("Id found\r\n");
-				index -= 4;
-				EEPROM_read(index);
-				len[0] = EEDR;
-				index++;
-				EEPROM_read(index);
-				len[1] = EEDR;
-				uart_printstr("len[0] = ");
-				uart_printhex(len[0]);
-				uart_printstr("\r\n");
-				uart_printstr("len[1] = ");
-				uart_printhex(len[1]);
-				uart_printstr("\r\n");
-				uint16_t	len_check = ((len[0] << 8) | len[1]);
-
-				if (length > len_check)
-				{
-					uart_printstr("Length of data is too long to write for this id\r\n");
-					return (false);
-				}
-				index += 5; // now on body part (skip length + id)
-				size_t	body_count = 0;
-				// see if anything identical would be replaced
-				while (body_count < length)
-				{
-					EEPROM_read(index);
-					uart_printstr("EEDR read = ");
-					uart_printhex(EEDR);
-					uart_printstr("\r\n");
-					uart_printstr("buffer[i] = ");
-					uart_printhex(tmp[body_count]);
-					uart_printstr("\r\n");
-					if (EEDR != tmp[body_count])
-					{
-						uart_printstr("NOT identical\r\n");
-						EEPROM_write(index, tmp[body_count]);
-					}
-					body_count++;
-					index++;
-				}
+				bytes += (uint16_t)(eeq_programmed() - before);
+				allocs++;
 			}
-			/*************ID NOT FOUND**************/
 		}
-		index++;
-		i++;
-		t = 0;
+		else if (bench_rand() % 2)
+		{
+			eepromalloc_free(id);
+			live[id] = 0;
+		}
+		else
+		{
+			while (compact_step())
+			{}
+		}
+		round++;
 	}
-	/**********************NO ID HAS BEEN FOUND*********************/
+	uart_printstr("new blocks : ");
+	uart_printnumber(allocs);
+	uart_printstr(", bytes programmed per block x10 : ");
+	uart_printnumber(bytes * 10 / allocs);
+	uart_printstr("\r\n");
+}
+#endif
 
-	size_t	start = find_free_spot(length);
-	if (start >= 1018)
+#ifdef CACHE_BENCH
+/*********************CACHE BENCHMARK*************************/
+// make DEFS=-DCACHE_BENCH, then DEFS="-DCACHE_BENCH -DEE_CACHE_LINES=0" : a random
+// alloc / read / free / compact session, cache hits and misses and the cells really read
+// from the EEPROM (each miss reads a whole line, the cache has to save more than that)
+#define CACHE_BENCH_IDS 40
+#define CACHE_BENCH_ROUNDS 1000
+
+void	cache_bench()
+{
+	uint8_t		live[CACHE_BENCH_IDS];
+	uint8_t		body[32];
+	uint8_t		id;
+	uint8_t		i = 0;
+	uint16_t	round = 0;
+
+	clear_eeprom(0, ALLOC_SIZE);
+	index_build();
+	EEPROM_flush();
+	eeq_cell_reads = 0;
+#if EE_CACHE_LINES
+	ee_cache_hits = 0;
+	ee_cache_misses = 0;
+#endif
+	while (i < CACHE_BENCH_IDS)
+		live[i++] = 0;
+	while (round < CACHE_BENCH_ROUNDS)
 	{
-		uart_printstr("ERROR : could not find any free spot in the memory\r\n");
-		return (false);
+		id = bench_rand() % CACHE_BENCH_IDS;
+		if (!live[id])
+		{
+			i = 0;
+			while (i < sizeof(body))
+				body[i++] = bench_rand();
+			live[id] = eepromalloc_write(id, body, 1 + bench_rand() % sizeof(body));
+		}
+		else if (bench_rand() % 3 == 0)
+		{
+			eepromalloc_free(id);
+			live[id] = 0;
+		}
+		else if (bench_rand() % 2)
+			eepromalloc_read(id, body, 1);
+		else
+			compact_step();
+		round++;
 	}
+#if EE_CACHE_LINES
+	ee_cache_report();
+#endif
+	uart_printstr("EEPROM cells read : ");
+	uart_printnumber(eeq_cell_reads);
+	uart_printstr("\r\n");
+}
+#endif
+
+#ifdef EEPM_BENCH
+/*********************PROGRAMMING MODES BENCHMARK*************************/
+// a typical allocator session, then the programming time from the counters of
+// EE_READY_vect (doc 8.4 - Table 8-2) : what it costs now against every queued byte
+// going through an atomic erase + write like the datasheet EEPROM_write did
+#define EEPM_BENCH_BLOCKS 12
 
-	/*************SET MAGIC****************/
-	index = start;
-	uint8_t	new_mag_tab[2];
-	new_mag_tab[1] = ((MAGIC_NUMBER & 0xFF00) >> 8);
-	EEPROM_write(index, new_mag_tab[1]);
-	index++;
-	new_mag_tab[0] = (MAGIC_NUMBER & 0x00FF);
-	EEPROM_write(index, new_mag_tab[0]);
-
-	/*************SET LENGTH****************/
-	index++;
-	uint8_t	new_length_tab[2];
-	new_length_tab[1] = ((length & 0xFF00) >> 8);
-	EEPROM_write(index, new_length_tab[1]);
-	index++;
-	new_length_tab[0] = (length & 0x00FF);
-	EEPROM_write(index, new_length_tab[0]);
-
-	/*************SET ID****************/
-	index++;
-	uint16_t	new_id = find_id(ids);
-	uint8_t	new_id_tab[2];
-	new_id_tab[1] = ((new_id & 0xFF00) >> 8);
-	EEPROM_write(index, new_id_tab[1]);
-	index++;
-	new_id_tab[0] = (new_id & 0x00FF);
-	EEPROM_write(index, new_id_tab[0]);
-
-	index++;
-	size_t	body_count = 0;
-	while (body_count < length)
-	{
-		EEPROM_write(index, tmp[body_count]);
-		body_count++;
-		index++;
+void	eepm_bench()
+{
+	uint8_t		body[16] = "bench data 0123";
+	uint16_t	i = 0;
+	uint32_t	total;
+	uint32_t	us;
+
+	clear_eeprom(0, ALLOC_SIZE);
+	index_build();
+	EEPROM_flush();
+	eeq_stats.atomic = 0; // only the session is counted, not the clear
+	eeq_stats.erase = 0;
+	eeq_stats.write = 0;
+	eeq_stats.skip = 0;
+	while (i < EEPM_BENCH_BLOCKS)
+	{
+		eepromalloc_write(i, body, sizeof(body));
+		i++;
 	}
-	uart_printstr("Succesfully wrote a fresh new block and its headers in a free spot\r\n");
-	return (true); // no existant data written by me found before
-}	
+	i = 0;
+	while (i < EEPM_BENCH_BLOCKS)
+	{
+		body[0] = 'a' + i;
+		if (i % 3 == 0)
+			eepromalloc_free(i);
+		else
+			eepromalloc_write(i, body, sizeof(body));
+		i++;
+	}
+	while (compact_step())
+	{}
+	EEPROM_flush();
+	total = (uint32_t)eeq_stats.atomic + eeq_stats.erase + eeq_stats.write + eeq_stats.skip;
+	us = (uint32_t)eeq_stats.atomic * 3400 + ((uint32_t)eeq_stats.erase + eeq_stats.write) * 1800;
+	uart_printstr("atomic : ");
+	uart_printnumber(eeq_stats.atomic);
+	uart_printstr(", erase only : ");
+	uart_printnumber(eeq_stats.erase);
+	uart_printstr(", write only : ");
+	uart_printnumber(eeq_stats.write);
+	uart_printstr(", skipped : ");
+	uart_printnumber(eeq_stats.skip);
+	uart_printstr("\r\nalways atomic, ms : ");
+	uart_printnumber(total * 34 / 10);
+	uart_printstr("\r\nper byte mode, ms : ");
+	uart_printnumber(us / 1000);
+	uart_printstr("\r\n");
+}
+#endif
 
 int	main()
 {
 	char	str[10];
 	char	str1[10];
-	// char	str2[10];
+	char	str2[10];
 	uart_init();
+	sei(); // the EEPROM write queue drains from EE_READY_vect
+	alloc_init();
+#ifdef ALLOC_BENCH
+	alloc_bench();
+#endif
+#ifdef EEPM_BENCH
+	eepm_bench();
+#endif
+#ifdef COMMIT_BENCH
+	commit_bench();
+#endif
+#ifdef CACHE_BENCH
+	cache_bench();
+#endif
 	// print_eeprom();
 	// clear_eeprom();
-	clear_eeprom(0x00, 0x31);
+	clear_eeprom(0x00, 0x60);
+	index_build();
 	print_eeprom(0x00, 0x31);
 	safe_eeprom_write("TEST0", 0x12, 5);
 	safe_eeprom_read(&str, 0x12, 5);
@@ -805,4 +1410,23 @@ int	main()
 	uart_printstr("\r\n");
 
 	print_eeprom(0x00, 0x31);
+
+	/*********************ALLOCATOR*************************/
+	eepromalloc_write(1, "AAAA", 4); // best fit : the 12 bytes before TEST0
+	eepromalloc_write(2, "BBBBBBBB", 8);
+	eepromalloc_write(3, "CCCCCCCCCC", 10);
+	eepromalloc_free(2);
+	eepromalloc_write(4, "DD", 2); // smallest hole that fits : where id 2 was
+	print_eeprom(0x00, 0x60);
+	while (compact_step()) // idle time, a few bytes per call
+	{}
+	eepromalloc_read(3, &str2, 9);
+	uart_printstr("What I read = ");
+	uart_printstr(str2);
+	uart_printstr("\r\n");
+	print_eeprom(0x00, 0x60);
+#if EE_CACHE_LINES
+	ee_cache_report();
+#endif
+	EEPROM_flush(); // the last writes are still in the queue
 }
\ No newline at end of file
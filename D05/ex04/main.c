@@ -0,0 +1,782 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <util/twi.h>
+#include <util/crc16.h>
+#include <stdbool.h>
+/*********************INTRODUCTION*************************/
+// unattended data logger : every LOG_PERIOD_S seconds the AHT20 (D04/ex02), the internal
+// temperature (D07/ex03), the LDR and the NTC (D07/ex02) are sampled and appended to a
+// ring log filling the whole 1 KB EEPROM.
+// A raw sample is 14 bytes (time + 5 x 16-bit), here only what changed is stored :
+//
+// the EEPROM is cut in LOG_PAGES pages of LOG_PAGE_SIZE bytes, the oldest page is reused
+// page = header, then records until the page is full or a 0xFF record byte (erased)
+// header = LOG_MAGIC, seq (2 bytes LE), flags, time in s (4 bytes LE), then the 5 values
+//          as zigzag varints : the first sample of the page, in full
+// record = mask byte, then a varint dt if mask bit 5 is set (else dt = LOG_PERIOD_S),
+//          then a zigzag varint delta for each field whose bit (0 to 4) is set in the mask
+// varint = 7 bits per byte, low bits first, bit 7 set when another byte follows
+// zigzag = 0, -1, 1, -2, 2... as 0, 1, 2, 3, 4...
+//
+// a quiet sample is a single 0x00 byte, a few small changes 2 to 4 bytes : 5 to 10 times
+// more samples than raw records. A field only counts as changed when it moved more than
+// its deadband, so the log is off by at most the deadband.
+//
+// commands : #PRINT decodes the log as CSV, #DUMP streams it for a host decoder,
+// #STATS prints the compression, #CLEAR empties the log
+// #DUMP = "LOG", LOG_PAGE_SIZE, LOG_PAGES, the pages oldest first, CRC16 (xmodem) of the
+// pages, high byte first
+
+#ifndef LOG_PERIOD_S
+# define LOG_PERIOD_S 60
+#endif
+#define LOG_FIELDS 5
+#define LOG_PAGE_SIZE 64
+#define LOG_PAGES (1024 / LOG_PAGE_SIZE)
+#define LOG_MAGIC 0xB5
+#define LOG_HEADER 8 // before the keyframe varints
+#define LOG_BOOT 0x01 // header flags : first page after a reset, time starts again from 0
+#define LOG_DT 0x20 // record mask : explicit dt
+#define LOG_FREE 0xFF
+#define LOG_RECORD_MAX (1 + 5 + LOG_FIELDS * 3) // mask, 32-bit varint, 16-bit varints
+#define LOG_RAW_RECORD (4 + LOG_FIELDS * 2)
+
+#define ACK 1
+#define NACK 0
+#define AHT20_ADDR 0x38
+
+#define COMMAND_SIZE 16
+#define WRONG_INPUT "\r\nWrong input, try : #PRINT, #DUMP, #STATS or #CLEAR\r\n"
+
+typedef struct	s_sample
+{
+	uint32_t	time;
+	int16_t		values[LOG_FIELDS];
+}	t_sample;
+
+// aht20 temperature (0.1 C), aht20 humidity (0.1 %), internal sensor, LDR, NTC (ADC LSB)
+const int16_t	log_deadband[LOG_FIELDS] = {1, 2, 1, 4, 2};
+
+uint8_t		log_page = LOG_PAGES - 1; // page being filled
+uint8_t		log_pos = LOG_PAGE_SIZE; // next free byte in it
+uint16_t	log_seq = 0xFFFF;
+t_sample	log_last; // what the decoder will have after the last record
+
+volatile uint32_t	uptime = 0;
+volatile char		command[COMMAND_SIZE];
+volatile uint8_t	input_count = 0;
+volatile uint8_t	new_command = 0;
+
+void	uart_init()
+{
+	// UART config to 8N1 (8-bit, no parity, stop-bit = 1)
+	// doc 20.6 : enable transmitter 0
+	// doc 20.7 : enable receiver 0
+	UCSR0B |= (1 << TXEN0);
+	UCSR0B |= (1 << RXEN0);
+
+	// doc 20.11.4 - Table 20-8 : async mode chosen caue asked for "UART" with no S 00
+	UCSR0C &= ~(1 << UMSEL01);
+	UCSR0C &= ~(1 << UMSEL00);
+
+	// doc 20.11.4 - Table 20-9 : parity mode (checks of parity) = none 00
+	UCSR0C &= ~(1 << UPM01);
+	UCSR0C &= ~(1 << UPM00);
+
+	// doc 20.11.4 - Table 20-10 : stop bit select = one (bit set to 0)
+	UCSR0C &= ~(1 << USBS0);
+
+	// doc 20.11.4 - Table 20-11 : character size = 8-bit (011)
+	UCSR0C &= ~(1 << UCSZ02);
+	UCSR0C |= (1 << UCSZ01);
+	UCSR0C |= (1 << UCSZ00);
+
+	// doc 20.11.4 - Table 20-12 : clock plarity for sync mode only, set to 0 for async
+	UCSR0C &= ~(1 << UCPOL0);
+
+	// doc 20.3.1 - Table 20-1 : baudrate or UBRRn calculation
+	// doc 20.11.5 : USART baud rate set with UBRRnH-L
+	// UBRRn = (F_CPU / 8 * BAUD) - 1
+	UBRR0L = (float)((F_CPU / (16.0 * UART_BAUDRATE) + 0.5)) - 1;
+	UBRR0H = 0;
+}
+
+void	 uart_tx(char c)
+{
+	// doc 20.6.2 example of code
+	// doc 20.6.3 : checks when transmit buffer is empty
+	while (!(UCSR0A & (1<<UDRE0)))
+	{}
+	// doc 20.6.1 : sending frames (5 to 8 bits)
+	UDR0 = c;
+}
+
+void	uart_printstr(char *str)
+{
+	int	i = 0;
+	while (str[i])
+	{
+		uart_tx(str[i]);
+		i++;
+	}
+}
+
+void	uart_printnumber(uint32_t n)
+{
+	if (n >= 10)
+	{
+		uart_printnumber(n / 10);
+		uart_printnumber(n % 10);
+	}
+	else
+		uart_tx(n + '0');
+}
+
+void	uart_printsigned(int32_t n)
+{
+	if (n < 0)
+	{
+		uart_tx('-');
+		n = -n;
+	}
+	uart_printnumber(n);
+}
+
+// value / 10 with one decimal
+void	uart_printtenths(int16_t t)
+{
+	if (t < 0)
+	{
+		uart_tx('-');
+		t = -t;
+	}
+	uart_printnumber(t / 10);
+	uart_tx('.');
+	uart_tx('0' + t % 10);
+}
+
+/*********************EEPROM*************************/
+void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address and Data Registers */
+	EEAR = uiAddress;
+	EEDR = ucData;
+	// doc 8.6.3 : EEPE has to be set within 4 cycles after EEMPE, no interrupt in between
+	cli();
+	/* Write logical one to EEMPE */
+	EECR |= (1<<EEMPE);
+	/* Start eeprom write by setting EEPE */
+	EECR |= (1<<EEPE);
+	sei();
+}
+
+unsigned char EEPROM_read(unsigned int uiAddress)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address register */
+	EEAR = uiAddress;
+	/* Start eeprom read by writing EERE */
+	EECR |= (1<<EERE);
+	/* Return data from Data Register */
+	return EEDR;
+}
+
+// 3.4 ms per write, erased bytes are often already 0xFF
+void	EEPROM_update(unsigned int uiAddress, unsigned char ucData)
+{
+	if (EEPROM_read(uiAddress) != ucData)
+		EEPROM_write(uiAddress, ucData);
+}
+
+/*********************SENSORS*************************/
+void	i2c_init()
+{
+	TWCR |= (1 << TWEN);
+	TWSR = 0; // no prescaler
+	TWBR = ((F_CPU / 100000)-16) / (2 * 1); //100kH F_SCL frequency
+}
+
+void	i2c_start()
+{
+	TWCR = ((1<<TWINT) | (1<<TWEN) | (1<<TWSTA));
+	while (!(TWCR & (1 << TWINT))) // wait for the init message to be completly sent
+	{}
+}
+
+void	i2c_stop()
+{
+	TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
+}
+
+void	i2c_write(unsigned char data)
+{
+	TWDR = data;
+	TWCR = ((1 << TWEN) | (1 << TWINT) );
+	while (!(TWCR & (1 << TWINT)))
+	{}
+}
+
+uint8_t	i2c_read(int ack)
+{
+	if (ack)
+		TWCR = ((1 << TWEN) | (1 << TWINT) | (1 << TWEA));
+	else
+		TWCR = ((1 << TWEN) | (1 << TWINT ));
+	while (!(TWCR & (1 << TWINT)))
+	{}
+	return (TWDR);
+}
+
+void	aht20_init()
+{
+	_delay_ms(40);
+	i2c_start();
+	i2c_write((AHT20_ADDR << 1) | 1);
+	uint8_t	status = i2c_read(NACK);
+	i2c_stop();
+	if (!(status & (1 << 3))) // not calibrated yet
+	{
+		i2c_start();
+		i2c_write(AHT20_ADDR << 1);
+		i2c_write(0xBE);
+		i2c_write(0x08);
+		i2c_write(0x00);
+		i2c_stop();
+		_delay_ms(10);
+	}
+}
+
+// tenths of C and tenths of %, 20-bit raw values as in D04/ex02 without floats
+bool	aht20_read(int16_t *temp, int16_t *hum)
+{
+	uint8_t		bytes[5];
+	uint8_t		i = 0;
+
+	i2c_start();
+	i2c_write(AHT20_ADDR << 1);
+	i2c_write(0xAC);
+	i2c_write(0x33);
+	i2c_write(0x00);
+	i2c_stop();
+	_delay_ms(80);
+
+	i2c_start();
+	i2c_write((AHT20_ADDR << 1) | 1);
+	if (i2c_read(ACK) & (1 << 7)) // still busy
+	{
+		i2c_read(NACK);
+		i2c_stop();
+		return (false);
+	}
+	while (i < 5)
+	{
+		bytes[i] = i2c_read(ACK);
+		i++;
+	}
+	i2c_read(NACK); // CRC data
+	i2c_stop();
+
+	uint32_t	h = ((uint32_t)bytes[0] << 12) | ((uint32_t)bytes[1] << 4) | (bytes[2] >> 4);
+	uint32_t	t = (((uint32_t)bytes[2] & 0x0F) << 16) | ((uint32_t)bytes[3] << 8) | bytes[4];
+	*hum = (h * 1000) >> 20;
+	*temp = (int16_t)((t * 2000) >> 20) - 500;
+	return (true);
+}
+
+void	adc_init()
+{
+	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
+	ADCSRA |= (1 << ADPS2);
+	ADCSRA |= (1 << ADPS1);
+	ADCSRA |= (1 << ADPS0);
+
+	// Enable ADC (ADEN)
+	ADCSRA |= (1 << ADEN);
+}
+
+// average of 16 conversions.
+// doc 24.5.2 : after a reference switch AREF needs time and the first conversion is wrong
+uint16_t	adc_read(uint8_t admux)
+{
+	uint16_t	sum = 0;
+	uint8_t		i = 0;
+
+	if ((ADMUX ^ admux) & ((1 << REFS1) | (1 << REFS0)))
+	{
+		ADMUX = admux;
+		_delay_ms(20);
+		ADCSRA |= (1 << ADSC);
+		while (ADCSRA & (1 << ADSC))
+		{}
+	}
+	ADMUX = admux;
+	while (i < 16)
+	{
+		ADCSRA |= (1 << ADSC);
+		while (ADCSRA & (1 << ADSC))
+		{}
+		sum += ADC;
+		i++;
+	}
+	return (sum / 16);
+}
+
+// the AHT20 keeps its last values if it was busy
+void	sample(t_sample *s)
+{
+	s->time = uptime;
+	aht20_read(&s->values[0], &s->values[1]);
+	s->values[3] = adc_read((1 << REFS0) | 1); // LDR on ADC1, AVcc
+	s->values[4] = adc_read((1 << REFS0) | 2); // NTC on ADC2, AVcc
+	// doc 24.8 : internal sensor on ADC8, 1.1V only, read last so AVcc is only switched once
+	s->values[2] = adc_read((1 << REFS1) | (1 << REFS0) | 8);
+}
+
+/*********************ENCODING*************************/
+uint8_t	put_varint(uint8_t *buf, uint32_t v)
+{
+	uint8_t	len = 0;
+
+	while (v >= 0x80)
+	{
+		buf[len] = (v & 0x7F) | 0x80;
+		v >>= 7;
+		len++;
+	}
+	buf[len] = v;
+	return (len + 1);
+}
+
+uint16_t	zigzag(int16_t v)
+{
+	return ((uint16_t)((uint16_t)v << 1) ^ (uint16_t)(v >> 15));
+}
+
+int16_t	unzigzag(uint16_t v)
+{
+	return ((int16_t)(v >> 1) ^ -(int16_t)(v & 1));
+}
+
+// reader over one page, stops at the end of the page
+typedef struct	s_reader
+{
+	uint16_t	addr;
+	uint16_t	end;
+}	t_reader;
+
+bool	get_byte(t_reader *r, uint8_t *b)
+{
+	if (r->addr >= r->end)
+		return (false);
+	*b = EEPROM_read(r->addr);
+	r->addr++;
+	return (true);
+}
+
+bool	get_varint(t_reader *r, uint32_t *v)
+{
+	uint8_t	b;
+	uint8_t	shift = 0;
+
+	*v = 0;
+	do
+	{
+		if (shift > 28 || !get_byte(r, &b))
+			return (false);
+		*v |= (uint32_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return (true);
+}
+
+/*********************RING LOG*************************/
+uint16_t	page_addr(uint8_t page)
+{
+	return ((uint16_t)page * LOG_PAGE_SIZE);
+}
+
+bool	page_valid(uint8_t page, uint16_t *seq)
+{
+	uint16_t	addr = page_addr(page);
+
+	if (EEPROM_read(addr) != LOG_MAGIC)
+		return (false);
+	*seq = EEPROM_read(addr + 1) | (EEPROM_read(addr + 2) << 8);
+	return (true);
+}
+
+// writes bytes 1 to len - 1 first and byte 0 last : a reset in the middle leaves an erased
+// first byte (no page magic, or a 0xFF record mask) and the unfinished data is never read
+void	log_commit(uint16_t addr, uint8_t *buf, uint8_t len)
+{
+	uint8_t	i = 1;
+
+	while (i < len)
+	{
+		EEPROM_update(addr + i, buf[i]);
+		i++;
+	}
+	EEPROM_update(addr, buf[0]);
+}
+
+// next page, erased magic first so a half erased page is already invalid
+void	log_open(t_sample *s, uint8_t flags)
+{
+	uint8_t		buf[LOG_HEADER + LOG_FIELDS * 3];
+	uint8_t		len = LOG_HEADER;
+	uint8_t		i = 0;
+	uint16_t	addr;
+
+	log_page = (log_page + 1) % LOG_PAGES;
+	log_seq++;
+	addr = page_addr(log_page);
+	while (i < LOG_PAGE_SIZE)
+	{
+		EEPROM_update(addr + i, LOG_FREE);
+		i++;
+	}
+	buf[0] = LOG_MAGIC;
+	buf[1] = log_seq;
+	buf[2] = log_seq >> 8;
+	buf[3] = flags;
+	buf[4] = s->time;
+	buf[5] = s->time >> 8;
+	buf[6] = s->time >> 16;
+	buf[7] = s->time >> 24;
+	i = 0;
+	while (i < LOG_FIELDS)
+	{
+		len += put_varint(buf + len, zigzag(s->values[i]));
+		i++;
+	}
+	log_commit(addr, buf, len);
+	log_pos = len;
+	log_last = *s;
+}
+
+void	log_append(t_sample *s)
+{
+	uint8_t		buf[LOG_RECORD_MAX];
+	uint8_t		len = 1;
+	uint8_t		i = 0;
+	uint32_t	dt = s->time - log_last.time;
+	t_sample	next = log_last;
+
+	buf[0] = 0;
+	if (dt != LOG_PERIOD_S)
+	{
+		buf[0] |= LOG_DT;
+		len += put_varint(buf + len, dt);
+	}
+	while (i < LOG_FIELDS)
+	{
+		int16_t	delta = s->values[i] - log_last.values[i];
+		if (delta > log_deadband[i] || delta < -log_deadband[i])
+		{
+			buf[0] |= (1 << i);
+			len += put_varint(buf + len, zigzag(delta));
+			next.values[i] = s->values[i];
+		}
+		i++;
+	}
+	if (log_pos + len > LOG_PAGE_SIZE)
+	{
+		log_open(s, 0);
+		return ;
+	}
+	log_commit(page_addr(log_page) + log_pos, buf, len);
+	log_pos += len;
+	next.time = s->time;
+	log_last = next;
+}
+
+// finds the newest page, O(LOG_PAGES) reads. The time restarts at 0 after a reset so
+// the first sample always opens a new page flagged LOG_BOOT
+void	log_init()
+{
+	uint8_t		page = 0;
+	uint16_t	seq;
+	bool		found = false;
+
+	while (page < LOG_PAGES)
+	{
+		if (page_valid(page, &seq) && (!found || (int16_t)(seq - log_seq) > 0))
+		{
+			log_seq = seq;
+			log_page = page;
+			found = true;
+		}
+		page++;
+	}
+}
+
+void	log_clear()
+{
+	uint16_t	addr = 0;
+
+	while (addr < LOG_PAGES * LOG_PAGE_SIZE)
+	{
+		EEPROM_update(addr, LOG_FREE);
+		addr++;
+	}
+	log_page = LOG_PAGES - 1;
+	log_pos = LOG_PAGE_SIZE; // next sample opens page 0
+}
+
+/*********************DECODER*************************/
+void	print_sample(t_sample *s)
+{
+	uint8_t	i = 0;
+
+	uart_printnumber(s->time);
+	while (i < LOG_FIELDS)
+	{
+		uart_tx(',');
+		if (i < 2)
+			uart_printtenths(s->values[i]);
+		else
+			uart_printsigned(s->values[i]);
+		i++;
+	}
+	uart_printstr("\r\n");
+}
+
+// decodes one page, prints it if print is set, returns the number of samples
+uint16_t	decode_page(uint8_t page, bool print, uint16_t *used)
+{
+	t_reader	r = {page_addr(page) + 3, page_addr(page) + LOG_PAGE_SIZE};
+	t_sample	s;
+	uint8_t		flags;
+	uint8_t		mask;
+	uint32_t	v;
+	uint16_t	count = 1;
+	uint8_t		i = 0;
+
+	get_byte(&r, &flags);
+	s.time = 0;
+	while (i < 4)
+	{
+		uint8_t	b;
+		get_byte(&r, &b);
+		s.time |= (uint32_t)b << (8 * i);
+		i++;
+	}
+	i = 0;
+	while (i < LOG_FIELDS)
+	{
+		if (!get_varint(&r, &v))
+			return (0);
+		s.values[i] = unzigzag(v);
+		i++;
+	}
+	*used = r.addr - page_addr(page);
+	if (print)
+	{
+		if (flags & LOG_BOOT)
+			uart_printstr("# boot\r\n");
+		print_sample(&s);
+	}
+	while (get_byte(&r, &mask) && mask != LOG_FREE)
+	{
+		v = LOG_PERIOD_S;
+		if ((mask & LOG_DT) && !get_varint(&r, &v))
+			break ;
+		s.time += v;
+		i = 0;
+		while (i < LOG_FIELDS)
+		{
+			if (mask & (1 << i))
+			{
+				if (!get_varint(&r, &v))
+					return (count);
+				s.values[i] += unzigzag(v);
+			}
+			i++;
+		}
+		if (print)
+			print_sample(&s);
+		count++;
+		*used = r.addr - page_addr(page);
+	}
+	return (count);
+}
+
+// oldest page first : the one after the newest
+void	log_print(bool print)
+{
+	uint8_t		n = 0;
+	uint8_t		page;
+	uint16_t	seq;
+	uint16_t	samples = 0;
+	uint32_t	bytes = 0;
+
+	if (print)
+		uart_printstr("\r\ntime_s,aht20_c,aht20_rh,chip_lsb,ldr_lsb,ntc_lsb\r\n");
+	while (n < LOG_PAGES)
+	{
+		page = (log_page + 1 + n) % LOG_PAGES;
+		if (page_valid(page, &seq))
+		{
+			uint16_t	used = 0;
+			samples += decode_page(page, print, &used);
+			bytes += used;
+		}
+		n++;
+	}
+	if (print)
+		return ;
+	uart_printstr("\r\nsamples : ");
+	uart_printnumber(samples);
+	uart_printstr("\r\nEEPROM bytes used : ");
+	uart_printnumber(bytes);
+	uart_printstr("\r\nraw bytes : ");
+	uart_printnumber((uint32_t)samples * LOG_RAW_RECORD);
+	if (bytes)
+	{
+		uart_printstr("\r\nratio x10 : ");
+		uart_printnumber((uint32_t)samples * LOG_RAW_RECORD * 10 / bytes);
+	}
+	uart_printstr("\r\n");
+}
+
+void	log_dump()
+{
+	uint16_t	crc = 0;
+	uint8_t		n = 0;
+	uint8_t		i;
+	uint8_t		b;
+
+	uart_printstr("LOG");
+	uart_tx(LOG_PAGE_SIZE);
+	uart_tx(LOG_PAGES);
+	while (n < LOG_PAGES)
+	{
+		uint16_t	addr = page_addr((log_page + 1 + n) % LOG_PAGES);
+		i = 0;
+		while (i < LOG_PAGE_SIZE)
+		{
+			b = EEPROM_read(addr + i);
+			crc = _crc_xmodem_update(crc, b);
+			uart_tx(b);
+			i++;
+		}
+		n++;
+	}
+	uart_tx(crc >> 8);
+	uart_tx(crc);
+}
+
+/*********************COMMANDS*************************/
+// doc 16.11.1 - Table 16-4 : CTC on OCR1A (0100), prescaler 1024 -> 15625 Hz
+void	timer1_init()
+{
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12) | (1 << CS12) | (1 << CS10);
+	OCR1A = (F_CPU / 1024) - 1; // 1 s
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	uptime++;
+}
+
+uint32_t	uptime_now()
+{
+	uint32_t	s;
+
+	cli();
+	s = uptime;
+	sei();
+	return (s);
+}
+
+// only buffers the line, commands read the whole EEPROM so they run in the main loop
+ISR(USART_RX_vect)
+{
+	char	c = UDR0;
+
+	if (new_command)
+		return ;
+	uart_tx(c);
+	if (c == '\r') // newline detected
+	{
+		command[input_count] = '\0';
+		new_command = 1;
+		return ;
+	}
+	if (input_count < COMMAND_SIZE - 1)
+		command[input_count++] = c;
+}
+
+bool	command_is(char *ref)
+{
+	uint8_t	i = 0;
+
+	while (ref[i])
+	{
+		if (command[i] != ref[i])
+			return (false);
+		i++;
+	}
+	return (command[i] == '\0');
+}
+
+void	run_command()
+{
+	if (command_is("#PRINT"))
+		log_print(true);
+	else if (command_is("#DUMP"))
+		log_dump();
+	else if (command_is("#STATS"))
+		log_print(false);
+	else if (command_is("#CLEAR"))
+	{
+		log_clear();
+		uart_printstr("\r\nLog cleared\r\n");
+	}
+	else
+		uart_printstr(WRONG_INPUT);
+}
+
+int	main()
+{
+	t_sample	s = {0, {0, 0, 0, 0, 0}};
+	uint32_t	last = 0;
+	uint8_t		flags = LOG_BOOT;
+
+	uart_init();
+	i2c_init();
+	adc_init();
+	timer1_init();
+	sei();
+	// doc 20.11.3 : RX complete interrupt enable
+	UCSR0B |= (1 << RXCIE0);
+	aht20_init();
+	log_init();
+
+	while (1)
+	{
+		if (new_command)
+		{
+			run_command();
+			cli();
+			input_count = 0;
+			new_command = 0;
+			sei();
+		}
+		if (!flags && uptime_now() - last < LOG_PERIOD_S)
+			continue ;
+		sample(&s);
+		last = s.time;
+		if (flags || log_pos >= LOG_PAGE_SIZE)
+			log_open(&s, flags);
+		else
+			log_append(&s);
+		flags = 0;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,677 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+/*********************INTRODUCTION*************************/
+// key-value store for configuration data (baud rate, LED presets, calibration constants,
+// thresholds) : short string keys instead of the allocator ids of ex03 that the caller
+// has to know, and no walk of the EEPROM to find them.
+//
+// KV_SLOTS fixed size slots after a header at KV_BASE, open addressing : a key lives in
+// the first slot of its probe sequence (hash % KV_SLOTS, then the next ones) that was free
+// when it was written, a lookup follows the same sequence and stops at the first empty slot.
+// slot = hash[2] (high byte first), key[KV_KEY_SIZE] (0 padded), info, value[KV_VALUE_SIZE]
+// info = generation (high nibble) | value length (low nibble), a length above
+// KV_VALUE_SIZE is a corrupt slot : never returned, a new value for the key replaces it.
+// header = version, magic : kv_init formats the region when they do not match (first
+// boot, other data or another layout there), the magic is written last.
+// hash high byte : 0xFF empty (erased), KV_DELETED bit set deleted, else in use.
+// Hashes are 15 bits so a hash in use never looks erased or deleted.
+//
+// A slot is written with the hash high byte last, a reset before it leaves an empty slot.
+// A new value for a key goes in a new slot, the old one is deleted afterwards (one byte),
+// a reset in between leaves two slots for the key : kv_init keeps the newer generation.
+// The hashes are kept in SRAM (kv_hash), a lookup only reads the EEPROM to compare keys.
+// A deleted slot goes back to empty as soon as no key in use is probed through it.
+//
+// commands : #PUT key value, #GET key, #DEL key, #LIST, #STATS
+#define KV_BASE 0x000 // reserved region, KV_HEADER + KV_SLOTS * KV_SLOT_SIZE bytes
+#define KV_HEADER 2
+#define KV_VERSION 1 // header offset 0, to change with the slot layout
+#define KV_MAGIC 0x4B // header offset 1, 'K'
+#define KV_SLOTS 32 // power of 2
+#define KV_SLOT_SIZE 16
+#define KV_KEY_SIZE 7
+#define KV_VALUE_SIZE 6
+#define KV_KEY 2 // offsets in a slot
+#define KV_INFO (KV_KEY + KV_KEY_SIZE)
+#define KV_VALUE (KV_INFO + 1)
+#define KV_EMPTY 0xFFFF
+#define KV_DELETED 0x8000
+#define KV_NONE 0xFF
+
+#define COMMAND_SIZE 32
+#define WRONG_INPUT "\r\nWrong input, try : #PUT key value, #GET key, #DEL key, #LIST or #STATS\r\n"
+
+uint16_t	kv_hash[KV_SLOTS]; // copy of the slot hashes
+
+volatile char		command[COMMAND_SIZE];
+volatile uint8_t	input_count = 0;
+volatile uint8_t	new_command = 0;
+
+void	uart_init()
+{
+	// UART config to 8N1 (8-bit, no parity, stop-bit = 1)
+	// doc 20.6 : enable transmitter 0
+	// doc 20.7 : enable receiver 0
+	UCSR0B |= (1 << TXEN0);
+	UCSR0B |= (1 << RXEN0);
+
+	// doc 20.11.4 - Table 20-8 : async mode chosen caue asked for "UART" with no S 00
+	UCSR0C &= ~(1 << UMSEL01);
+	UCSR0C &= ~(1 << UMSEL00);
+
+	// doc 20.11.4 - Table 20-9 : parity mode (checks of parity) = none 00
+	UCSR0C &= ~(1 << UPM01);
+	UCSR0C &= ~(1 << UPM00);
+
+	// doc 20.11.4 - Table 20-10 : stop bit select = one (bit set to 0)
+	UCSR0C &= ~(1 << USBS0);
+
+	// doc 20.11.4 - Table 20-11 : character size = 8-bit (011)
+	UCSR0C &= ~(1 << UCSZ02);
+	UCSR0C |= (1 << UCSZ01);
+	UCSR0C |= (1 << UCSZ00);
+
+	// doc 20.11.4 - Table 20-12 : clock plarity for sync mode only, set to 0 for async
+	UCSR0C &= ~(1 << UCPOL0);
+
+	// doc 20.3.1 - Table 20-1 : baudrate or UBRRn calculation
+	// doc 20.11.5 : USART baud rate set with UBRRnH-L
+	// UBRRn = (F_CPU / 8 * BAUD) - 1
+	UBRR0L = (float)((F_CPU / (16.0 * UART_BAUDRATE) + 0.5)) - 1;
+	UBRR0H = 0;
+}
+
+void	 uart_tx(char c)
+{
+	// doc 20.6.2 example of code
+	// doc 20.6.3 : checks when transmit buffer is empty
+	while (!(UCSR0A & (1<<UDRE0)))
+	{}
+	// doc 20.6.1 : sending frames (5 to 8 bits)
+	UDR0 = c;
+}
+
+void	uart_printstr(char *str)
+{
+	int	i = 0;
+	while (str[i])
+	{
+		uart_tx(str[i]);
+		i++;
+	}
+}
+
+void	uart_printnumber(uint32_t n)
+{
+	if (n >= 10)
+	{
+		uart_printnumber(n / 10);
+		uart_printnumber(n % 10);
+	}
+	else
+		uart_tx(n + '0');
+}
+
+/*********************EEPROM*************************/
+void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address and Data Registers */
+	EEAR = uiAddress;
+	EEDR = ucData;
+	// doc 8.6.3 : EEPE has to be set within 4 cycles after EEMPE, no interrupt in between
+	cli();
+	/* Write logical one to EEMPE */
+	EECR |= (1<<EEMPE);
+	/* Start eeprom write by setting EEPE */
+	EECR |= (1<<EEPE);
+	sei();
+}
+
+unsigned char EEPROM_read(unsigned int uiAddress)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address register */
+	EEAR = uiAddress;
+	/* Start eeprom read by writing EERE */
+	EECR |= (1<<EERE);
+	/* Return data from Data Register */
+	return EEDR;
+}
+
+// 3.4 ms per write, erased bytes are often already 0xFF
+void	EEPROM_update(unsigned int uiAddress, unsigned char ucData)
+{
+	if (EEPROM_read(uiAddress) != ucData)
+		EEPROM_write(uiAddress, ucData);
+}
+
+/*********************KEY-VALUE STORE*************************/
+// FNV-1a folded to 15 bits
+uint16_t	kv_hash_key(char *key)
+{
+	uint32_t	h = 2166136261UL;
+	uint8_t		i = 0;
+
+	while (key[i])
+	{
+		h ^= (uint8_t)key[i];
+		h *= 16777619UL;
+		i++;
+	}
+	return ((h ^ (h >> 16)) & 0x7FFF);
+}
+
+// 0 for an empty key or one longer than KV_KEY_SIZE
+uint8_t	kv_key_length(char *key)
+{
+	uint8_t	i = 0;
+
+	while (key[i] && i <= KV_KEY_SIZE)
+		i++;
+	return (i <= KV_KEY_SIZE ? i : 0);
+}
+
+uint16_t	kv_slot_addr(uint8_t slot)
+{
+	return (KV_BASE + KV_HEADER + slot * KV_SLOT_SIZE);
+}
+
+bool	kv_used(uint8_t slot)
+{
+	return (!(kv_hash[slot] & KV_DELETED));
+}
+
+uint8_t	kv_info(uint8_t slot)
+{
+	return (EEPROM_read(kv_slot_addr(slot) + KV_INFO));
+}
+
+// value length, KV_NONE for a corrupt slot
+uint8_t	kv_length(uint8_t slot)
+{
+	uint8_t	length = kv_info(slot) & 0x0F;
+
+	if (length > KV_VALUE_SIZE)
+		return (KV_NONE);
+	return (length);
+}
+
+bool	kv_key_is(uint8_t slot, char *key)
+{
+	uint16_t	addr = kv_slot_addr(slot) + KV_KEY;
+	uint8_t		i = 0;
+
+	while (i < KV_KEY_SIZE)
+	{
+		if (EEPROM_read(addr + i) != (uint8_t)key[i])
+			return (false);
+		if (!key[i])
+			return (true);
+		i++;
+	}
+	return (true);
+}
+
+bool	kv_value_is(uint8_t slot, uint8_t *value, uint8_t length)
+{
+	uint16_t	addr = kv_slot_addr(slot) + KV_VALUE;
+	uint8_t		i = 0;
+
+	if (length > KV_VALUE_SIZE || kv_length(slot) != length)
+		return (false);
+	while (i < length)
+	{
+		if (EEPROM_read(addr + i) != value[i])
+			return (false);
+		i++;
+	}
+	return (true);
+}
+
+// slot holding key, KV_NONE if it is not stored
+// the hashes are compared in SRAM, the EEPROM is only read when they match
+uint8_t	kv_find(char *key, uint16_t hash)
+{
+	uint8_t	slot = hash % KV_SLOTS;
+	uint8_t	n = 0;
+
+	while (n < KV_SLOTS && kv_hash[slot] != KV_EMPTY)
+	{
+		if (kv_hash[slot] == hash && kv_key_is(slot, key))
+			return (slot);
+		slot = (slot + 1) % KV_SLOTS;
+		n++;
+	}
+	return (KV_NONE);
+}
+
+// first empty or deleted slot on the probe sequence of hash, the old copy of the key
+// stays until the new one is written
+uint8_t	kv_find_free(uint16_t hash, uint8_t old)
+{
+	uint8_t	slot = hash % KV_SLOTS;
+	uint8_t	n = 0;
+
+	while (n < KV_SLOTS)
+	{
+		if (!kv_used(slot) && slot != old)
+			return (slot);
+		slot = (slot + 1) % KV_SLOTS;
+		n++;
+	}
+	return (KV_NONE);
+}
+
+// true if a key in use has to probe through slot to be found
+bool	kv_on_path(uint8_t slot)
+{
+	uint8_t	p = 0;
+	uint8_t	home;
+
+	while (p < KV_SLOTS)
+	{
+		home = kv_hash[p] % KV_SLOTS;
+		if (kv_used(p) && (slot - home + KV_SLOTS) % KV_SLOTS < (p - home + KV_SLOTS) % KV_SLOTS)
+			return (true);
+		p++;
+	}
+	return (false);
+}
+
+// deleted slots no lookup goes through any more are empty again, one byte each :
+// without it the table fills up with deleted slots and a missing key is a full loop
+void	kv_reclaim()
+{
+	uint8_t	slot = 0;
+
+	while (slot < KV_SLOTS)
+	{
+		if (!kv_used(slot) && kv_hash[slot] != KV_EMPTY && !kv_on_path(slot))
+		{
+			EEPROM_update(kv_slot_addr(slot), KV_EMPTY >> 8);
+			kv_hash[slot] = KV_EMPTY;
+		}
+		slot++;
+	}
+}
+
+// one byte, straight to empty when no lookup needs the slot. It has to be gone from the
+// EEPROM before kv_reclaim empties the slots on its own probe sequence
+void	kv_delete_slot(uint8_t slot)
+{
+	kv_hash[slot] = KV_DELETED | (kv_hash[slot] & 0xFF);
+	if (kv_on_path(slot))
+		EEPROM_update(kv_slot_addr(slot), KV_DELETED >> 8);
+	else
+	{
+		EEPROM_update(kv_slot_addr(slot), KV_EMPTY >> 8);
+		kv_hash[slot] = KV_EMPTY;
+	}
+	kv_reclaim();
+}
+
+bool	kv_same_key(uint8_t a, uint8_t b)
+{
+	uint8_t	i = 0;
+
+	while (i < KV_KEY_SIZE)
+	{
+		if (EEPROM_read(kv_slot_addr(a) + KV_KEY + i) != EEPROM_read(kv_slot_addr(b) + KV_KEY + i))
+			return (false);
+		i++;
+	}
+	return (true);
+}
+
+// a reset between the new slot of a key and the delete of the old one : the generation
+// that follows the other one is the newer copy
+void	kv_drop_duplicates()
+{
+	uint8_t	a = 0;
+	uint8_t	b;
+
+	while (a < KV_SLOTS)
+	{
+		b = a + 1;
+		while (kv_used(a) && b < KV_SLOTS)
+		{
+			if (kv_hash[b] == kv_hash[a] && kv_same_key(a, b))
+			{
+				if ((((kv_info(b) >> 4) - (kv_info(a) >> 4)) & 0x0F) == 1)
+					kv_delete_slot(a);
+				else
+					kv_delete_slot(b);
+			}
+			b++;
+		}
+		a++;
+	}
+}
+
+// all slots empty, then the header : a reset before the magic formats again at boot
+void	kv_format()
+{
+	uint8_t	slot = 0;
+
+	while (slot < KV_SLOTS)
+		EEPROM_update(kv_slot_addr(slot++), KV_EMPTY >> 8);
+	EEPROM_update(KV_BASE, KV_VERSION);
+	EEPROM_update(KV_BASE + 1, KV_MAGIC);
+}
+
+// at boot : the hashes go to SRAM, the high byte tells the state of the slot
+void	kv_init()
+{
+	uint8_t	slot = 0;
+	uint8_t	high;
+
+	if (EEPROM_read(KV_BASE + 1) != KV_MAGIC || EEPROM_read(KV_BASE) != KV_VERSION)
+		kv_format();
+	while (slot < KV_SLOTS)
+	{
+		high = EEPROM_read(kv_slot_addr(slot));
+		if (high == KV_EMPTY >> 8)
+			kv_hash[slot] = KV_EMPTY; // a hash cut before its high byte too
+		else if (high & (KV_DELETED >> 8))
+			kv_hash[slot] = KV_DELETED | EEPROM_read(kv_slot_addr(slot) + 1);
+		else
+			kv_hash[slot] = (high << 8) | EEPROM_read(kv_slot_addr(slot) + 1);
+		slot++;
+	}
+	kv_drop_duplicates();
+	kv_reclaim();
+}
+
+bool	kv_get(char *key, void *value, uint8_t *length)
+{
+	uint8_t	slot;
+	uint8_t	i = 0;
+
+	if (!kv_key_length(key))
+		return (false);
+	slot = kv_find(key, kv_hash_key(key));
+	if (slot == KV_NONE)
+		return (false);
+	*length = kv_length(slot);
+	if (*length == KV_NONE)
+		return (false);
+	while (i < *length)
+	{
+		((uint8_t *)value)[i] = EEPROM_read(kv_slot_addr(slot) + KV_VALUE + i);
+		i++;
+	}
+	return (true);
+}
+
+// the new value goes in a free slot, hash high byte last, then the old slot is deleted
+bool	kv_put(char *key, void *value, uint8_t length)
+{
+	uint8_t		key_length = kv_key_length(key);
+	uint16_t	hash;
+	uint16_t	addr;
+	uint8_t		old;
+	uint8_t		slot;
+	uint8_t		gen = 0;
+	uint8_t		i = 0;
+
+	if (!key_length || length > KV_VALUE_SIZE)
+		return (false);
+	hash = kv_hash_key(key);
+	old = kv_find(key, hash);
+	if (old != KV_NONE)
+	{
+		if (kv_value_is(old, value, length))
+			return (true);
+		gen = (kv_info(old) >> 4) + 1;
+	}
+	slot = kv_find_free(hash, old);
+	if (slot == KV_NONE)
+		return (false);
+	addr = kv_slot_addr(slot);
+	while (i < KV_KEY_SIZE)
+	{
+		EEPROM_update(addr + KV_KEY + i, i < key_length ? key[i] : 0);
+		i++;
+	}
+	i = 0;
+	while (i < length)
+	{
+		EEPROM_update(addr + KV_VALUE + i, ((uint8_t *)value)[i]);
+		i++;
+	}
+	EEPROM_update(addr + KV_INFO, ((gen & 0x0F) << 4) | length);
+	EEPROM_update(addr + 1, hash & 0xFF);
+	EEPROM_update(addr, hash >> 8); // last, the slot is complete
+	kv_hash[slot] = hash;
+	if (old != KV_NONE)
+		kv_delete_slot(old);
+	return (true);
+}
+
+bool	kv_delete(char *key)
+{
+	uint8_t	slot;
+
+	if (!kv_key_length(key))
+		return (false);
+	slot = kv_find(key, kv_hash_key(key));
+	if (slot == KV_NONE)
+		return (false);
+	kv_delete_slot(slot);
+	return (true);
+}
+
+// next key in use from *slot on : for (slot = 0; kv_next(&slot, ...); slot++)
+// key needs KV_KEY_SIZE + 1 bytes, corrupt slots are skipped
+bool	kv_next(uint8_t *slot, char *key, void *value, uint8_t *length)
+{
+	uint8_t	i;
+
+	while (*slot < KV_SLOTS)
+	{
+		if (kv_used(*slot) && kv_length(*slot) != KV_NONE)
+		{
+			i = 0;
+			while (i < KV_KEY_SIZE)
+			{
+				key[i] = EEPROM_read(kv_slot_addr(*slot) + KV_KEY + i);
+				i++;
+			}
+			key[i] = '\0';
+			if (kv_get(key, value, length))
+				return (true);
+		}
+		(*slot)++;
+	}
+	return (false);
+}
+
+/*********************COMMANDS*************************/
+void	print_value(uint8_t *value, uint8_t length)
+{
+	uint8_t	i = 0;
+
+	while (i < length)
+		uart_tx(value[i++]);
+}
+
+// #STATS : slots per state and probes per lookup, about 1 while the table is not too full
+void	kv_stats()
+{
+	uint8_t		slot = 0;
+	uint8_t		used = 0;
+	uint8_t		deleted = 0;
+	uint16_t	probes = 0;
+
+	while (slot < KV_SLOTS)
+	{
+		if (kv_used(slot))
+		{
+			used++;
+			probes += (slot - kv_hash[slot] % KV_SLOTS + KV_SLOTS) % KV_SLOTS + 1;
+		}
+		else if (kv_hash[slot] != KV_EMPTY)
+			deleted++;
+		slot++;
+	}
+	uart_printstr("\r\nused : ");
+	uart_printnumber(used);
+	uart_printstr(", deleted : ");
+	uart_printnumber(deleted);
+	uart_printstr(", empty : ");
+	uart_printnumber(KV_SLOTS - used - deleted);
+	uart_printstr(", probes per lookup x10 : ");
+	uart_printnumber(used ? probes * 10 / used : 0);
+	uart_printstr("\r\n");
+}
+
+void	kv_list()
+{
+	char	key[KV_KEY_SIZE + 1];
+	uint8_t	value[KV_VALUE_SIZE];
+	uint8_t	length;
+	uint8_t	slot = 0;
+
+	uart_printstr("\r\n");
+	while (kv_next(&slot, key, value, &length))
+	{
+		uart_printstr(key);
+		uart_printstr(" = ");
+		print_value(value, length);
+		uart_printstr("\r\n");
+		slot++;
+	}
+}
+
+// only buffers the line, commands write the EEPROM so they run in the main loop
+ISR(USART_RX_vect)
+{
+	char	c = UDR0;
+
+	if (new_command)
+		return ;
+	uart_tx(c);
+	if (c == '\r') // newline detected
+	{
+		command[input_count] = '\0';
+		new_command = 1;
+		return ;
+	}
+	if (input_count < COMMAND_SIZE - 1)
+		command[input_count++] = c;
+}
+
+// cuts command at the spaces : "#PUT key value" gives 3 words
+uint8_t	split_command(char **words, uint8_t max)
+{
+	char	*c = (char *)command;
+	uint8_t	n = 0;
+
+	while (*c && n < max)
+	{
+		while (*c == ' ')
+			*c++ = '\0';
+		if (!*c)
+			break ;
+		words[n++] = c;
+		while (*c && *c != ' ')
+			c++;
+	}
+	while (*c == ' ')
+		*c++ = '\0';
+	return (*c ? max + 1 : n);
+}
+
+bool	word_is(char *word, char *ref)
+{
+	uint8_t	i = 0;
+
+	while (ref[i])
+	{
+		if (word[i] != ref[i])
+			return (false);
+		i++;
+	}
+	return (word[i] == '\0');
+}
+
+uint8_t	word_length(char *word)
+{
+	uint8_t	i = 0;
+
+	while (word[i])
+		i++;
+	return (i);
+}
+
+void	run_command()
+{
+	char	*words[3];
+	uint8_t	n = split_command(words, 3);
+	uint8_t	value[KV_VALUE_SIZE];
+	uint8_t	length;
+
+	if (n == 3 && word_is(words[0], "#PUT"))
+	{
+		if (kv_put(words[1], words[2], word_length(words[2])))
+			uart_printstr("\r\nStored\r\n");
+		else
+			uart_printstr("\r\nKey longer than 7, value longer than 6 or store full\r\n");
+	}
+	else if (n == 2 && word_is(words[0], "#GET"))
+	{
+		if (!kv_get(words[1], value, &length))
+		{
+			uart_printstr("\r\nNo such key\r\n");
+			return ;
+		}
+		uart_printstr("\r\n");
+		print_value(value, length);
+		uart_printstr("\r\n");
+	}
+	else if (n == 2 && word_is(words[0], "#DEL"))
+		uart_printstr(kv_delete(words[1]) ? "\r\nDeleted\r\n" : "\r\nNo such key\r\n");
+	else if (n == 1 && word_is(words[0], "#LIST"))
+		kv_list();
+	else if (n == 1 && word_is(words[0], "#STATS"))
+		kv_stats();
+	else
+		uart_printstr(WRONG_INPUT);
+}
+
+int	main()
+{
+	uint8_t	value[KV_VALUE_SIZE];
+	uint8_t	length;
+
+	uart_init();
+	sei();
+	// doc 20.11.3 : RX complete interrupt enable
+	UCSR0B |= (1 << RXCIE0);
+	kv_init();
+	// defaults on a blank store
+	if (!kv_get("baud", value, &length))
+	{
+		kv_put("baud", "115200", 6);
+		kv_put("led0", "FF8000", 6);
+		kv_put("cal_g", "1.02", 4);
+		kv_put("thr_hi", "30", 2);
+	}
+	kv_list();
+
+	while (1)
+	{
+		if (new_command)
+		{
+			run_command();
+			cli();
+			input_count = 0;
+			new_command = 0;
+			sei();
+		}
+	}
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <avr/pgmspace.h>
 
 void	lights_off()
 {
@@ -76,21 +77,142 @@ void	set_rgb(uint8_t r, uint8_t g, uint8_t b)
 	OCR2B = b;
 }
 
-void wheel(uint8_t pos)
+/*********************HSV TO RGB*************************/
+// same integer kernel as D08/ex04 : hue 0 to HUE_MAX - 1, 6 sectors of 256 steps, in every
+// sector one channel is at val, one at p (the floor), and the last one goes up (t) or
+// down (q) : the table picks which is which, so there's no branch per sector
+#define HUE_SECTOR 256
+#define HUE_MAX (6 * HUE_SECTOR)
+#define HSV_V 0
+#define HSV_P 1
+#define HSV_Q 2
+#define HSV_T 3
+
+const uint8_t	hsv_sectors[6][3] PROGMEM = {
+	{HSV_V, HSV_T, HSV_P}, // red -> yellow
+	{HSV_Q, HSV_V, HSV_P}, // yellow -> green
+	{HSV_P, HSV_V, HSV_T}, // green -> cyan
+	{HSV_P, HSV_Q, HSV_V}, // cyan -> blue
+	{HSV_T, HSV_P, HSV_V}, // blue -> magenta
+	{HSV_V, HSV_P, HSV_Q}, // magenta -> red
+};
+
+// a * b / 255 with a shift, exact at both ends (scale8(a, 0) = 0, scale8(a, 255) = a)
+uint8_t	scale8(uint8_t a, uint8_t b)
 {
-	pos = 255 - pos;
-	if (pos < 85)
-		set_rgb(255 - pos * 3, 0, pos * 3);
-	else if (pos < 170)
-	{
-		pos = pos - 85;
-		set_rgb(0, pos * 3, 255 - pos * 3);
-	}
-	else
+	return (((uint16_t)a * (b + 1)) >> 8);
+}
+
+void	hsv_to_rgb(uint16_t hue, uint8_t sat, uint8_t val, uint8_t *rgb)
+{
+	const uint8_t	*sector = hsv_sectors[hue >> 8];
+	uint8_t			frac = hue; // position inside the sector
+	uint8_t			levels[4];
+
+	levels[HSV_V] = val;
+	levels[HSV_P] = scale8(val, 255 - sat);
+	levels[HSV_Q] = scale8(val, 255 - scale8(sat, frac));
+	levels[HSV_T] = scale8(val, 255 - scale8(sat, 255 - frac));
+	rgb[0] = levels[pgm_read_byte(&sector[0])];
+	rgb[1] = levels[pgm_read_byte(&sector[1])];
+	rgb[2] = levels[pgm_read_byte(&sector[2])];
+}
+
+// replaces wheel() : full saturation and brightness, hue 0 red, 512 green, 1024 blue
+void	set_hue(uint16_t hue)
+{
+	uint8_t	rgb[3];
+
+	hsv_to_rgb(hue % HUE_MAX, 255, 255, rgb);
+	set_rgb(rgb[0], rgb[1], rgb[2]);
+}
+
+/*********************ANIMATION ENGINE*************************/
+// same engine as D08/ex04 : a timer tick every ms, each effect draws frame n at its own
+// rate and the frames missed while the main loop was busy are skipped, so the effect
+// keeps its speed and the loop is free between frames.
+// timer0 and timer2 are the PWM of the LED, the tick is on timer1.
+#define EFFECT_NONE 0
+#define EFFECT_RAINBOW 1
+
+typedef struct	s_effect
+{
+	void		(*render)(uint16_t frame);
+	uint16_t	period; // ms between frames
+	uint16_t	frames; // 0 = loops forever
+}				t_effect;
+
+volatile uint16_t	anim_ms = 0;
+uint8_t				anim_effect = EFFECT_NONE;
+uint16_t			anim_frame = 0;
+uint16_t			anim_next = 0; // anim_ms of the next frame
+
+// doc 16.11.2 : compare match A interrupt, every OCR1A + 1 timer ticks
+ISR(TIMER1_COMPA_vect)
+{
+	anim_ms++;
+}
+
+void	anim_init()
+{
+	// doc 16.11.1 - Table 16-4 : CTC on OCR1A (0100), TCNT1 goes back to 0 after OCR1A
+	// doc 16.11.2 - Table 16-5 : prescaler 64 -> 250 kHz
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
+	OCR1A = (F_CPU / 64 / 1000) - 1; // 1 ms
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+uint16_t	anim_now()
+{
+	uint16_t	ms;
+
+	cli();
+	ms = anim_ms;
+	sei();
+	return (ms);
+}
+
+// 6 hue steps every 50 ms, the speed of the old counter and wheel() loop.
+// frame * 6 wraps at 65536, which is not a multiple of HUE_MAX : wrap the frame first
+void	fx_rainbow(uint16_t frame)
+{
+	set_hue((frame % (HUE_MAX / 6)) * 6);
+}
+
+const t_effect	effects[] = {
+	[EFFECT_RAINBOW] = {fx_rainbow, 50, 0},
+};
+
+void	anim_start(uint8_t effect)
+{
+	anim_effect = effect;
+	anim_frame = 0;
+	anim_next = anim_now();
+}
+
+void	anim_update()
+{
+	const t_effect	*fx;
+	uint16_t		now;
+	uint16_t		late;
+
+	if (anim_effect == EFFECT_NONE)
+		return ;
+	fx = &effects[anim_effect];
+	now = anim_now();
+	if ((int16_t)(now - anim_next) < 0) // not time yet (anim_ms wraps around)
+		return ;
+	late = (now - anim_next) / fx->period; // whole frames missed
+	anim_frame += late;
+	anim_next += (late + 1) * fx->period;
+	if (fx->frames && anim_frame >= fx->frames - 1)
 	{
-		pos = pos - 170;
-		set_rgb(pos * 3, 255 - pos * 3, 0);
+		anim_frame = fx->frames - 1; // last frame of a finite effect, then stop
+		anim_effect = EFFECT_NONE;
 	}
+	fx->render(anim_frame);
+	anim_frame++;
 }
 
 int main()
@@ -101,18 +223,15 @@ int main()
 	DDRD |= (1 << DDD3); // LED 5 : B : PD3(OC2B/INT1)
 
 	init_rgb();
-	int	counter = 0;
+	anim_init();
+	sei();
+	anim_start(EFFECT_RAINBOW);
 
 	/*****************************************/
 	/******************MAIN*******************/
 	while (1)
 	{
-		counter++;
-		if (counter == 255)
-			counter = 0;
-
-		wheel(counter);
-		_delay_ms(50);
+		anim_update();
 	}
 	return (0);
 }
\ No newline at end of file
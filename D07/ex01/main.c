@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
 void	uart_init()
@@ -70,23 +71,72 @@ void uart_printhex(uint8_t byte)
 	//nibble = 4 bits
 }
 
-void	adc_init()
+/*********************ADC SCANNER*************************/
+// RV1, LDR and NTC are converted one after the other in the background : free running
+// mode (doc 24.9.4 - ADTS = 000), ADC_vect stores every result and moves MUX on, so
+// reading a channel never waits for a conversion
+#define ADC_POT 0
+#define ADC_LDR 1
+#define ADC_NTC 2
+#define ADC_CHANNELS 3
+
+volatile uint8_t	adc_values[ADC_CHANNELS]; // ADCH, 8 bits
+volatile uint8_t	adc_seq[ADC_CHANNELS]; // + 1 for every new value
+uint8_t				adc_channel = 0; // channel of the conversion that ends in the ISR
+
+// AVcc reference (REFS0), left adjusted (ADLAR), input channel in MUX3..0
+uint8_t	adc_admux(uint8_t channel)
+{
+	return ((1 << REFS0) | (1 << ADLAR) | channel);
+}
+
+uint8_t	adc_channel_after(uint8_t channel, uint8_t n)
 {
-	// set Voltage reference to AVcc (01)
-	ADMUX &= ~(1 << REFS1);
-	ADMUX |= (1 << REFS0);
+	channel += n;
+	if (channel >= ADC_CHANNELS)
+		channel -= ADC_CHANNELS;
+	return (channel);
+}
+
+// doc 24.5.1 : in free running mode the next conversion has already started with the
+// previous ADMUX when the ISR runs, so the MUX written here is for the one after
+ISR(ADC_vect)
+{
+	ADMUX = adc_admux(adc_channel_after(adc_channel, 2));
+	adc_values[adc_channel] = ADCH;
+	adc_seq[adc_channel]++;
+	adc_channel = adc_channel_after(adc_channel, 1);
+}
 
+void	adc_init()
+{
 	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
 	ADCSRA |= (1 << ADPS2);
 	ADCSRA |= (1 << ADPS1);
 	ADCSRA |= (1 << ADPS0);
 
-	// Enable ADC (ADEN)
-	ADCSRA |= (1 << ADEN);
+	// doc 24.9.4 - Table 24-6 : trigger source = free running (000)
+	ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));
+	ADMUX = adc_admux(ADC_POT);
 
-	// we need to write 8 bits only so we do a left adjust result to get ADCH (8 bits read)
-	ADMUX |= (1 << ADLAR);
+	// Enable ADC (ADEN), auto trigger (ADATE), interrupt (ADIE) and start the first conversion
+	ADCSRA |= (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADSC);
+	// doc 24.5 : MUX can change one ADC clock (8 us) after ADSC, that's the second channel
+	_delay_us(10);
+	ADMUX = adc_admux(ADC_LDR);
+}
 
+// latest value of a channel, seq (if not null) tells if it's a new one
+uint8_t	adc_read(uint8_t channel, uint8_t *seq)
+{
+	uint8_t	value;
+
+	cli();
+	value = adc_values[channel];
+	if (seq)
+		*seq = adc_seq[channel];
+	sei();
+	return (value);
 }
 
 // potentiometer : measures difference of potential 
@@ -94,54 +144,27 @@ void	adc_init()
 
 int	main()
 {
-	adc_init();
-	// choose the wanted pin with 
-	// input channel selection table for the last 4 bits of ADMUX
+	uint8_t	seq;
+	uint8_t	last_seq;
 
 	uart_init();
+	adc_init();
+	sei();
 
+	adc_read(ADC_NTC, &last_seq);
 	while (1)
 	{
-		// we ant RV1 which is on ADC0 (ADC_POT) (0000)
-		// POTENTIOMETER
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		uart_printhex(ADCH);
+		// RV1 (ADC0), LDR (ADC1) and NTC (ADC2) : NTC is the last channel of a scan,
+		// a line once a scan has ended since the last one (a scan is about 0.3 ms)
+		adc_read(ADC_NTC, &seq);
+		if (seq == last_seq)
+			continue ;
+		last_seq = seq;
+		uart_printhex(adc_read(ADC_POT, 0));
 		uart_printstr(", ");
-
-		// we want LDR which is on ADC1 (ADC_) (0001)
-		// LUMINOSITY
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX |= (1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		uart_printhex(ADCH);
+		uart_printhex(adc_read(ADC_LDR, 0));
 		uart_printstr(", ");
-
-		// we want NTC which is on ADC2 (ADC_) (0010)
-		// TEMPERATURE
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX |= (1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		uart_printhex(ADCH);
+		uart_printhex(adc_read(ADC_NTC, 0));
 		uart_printstr("\r\n");
 		_delay_ms(20);
 	}
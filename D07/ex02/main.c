@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
 void	uart_init()
@@ -81,20 +82,193 @@ void	uart_printnumber(uint16_t n)
 		uart_tx(n + '0');
 }
 
-void	adc_init()
+/*********************ADC SCANNER*************************/
+// the channels are converted one after the other in the background : free running mode
+// (doc 24.9.4 - ADTS = 000), ADC_vect stores every result and moves MUX on, so reading
+// a channel never waits for a conversion
+#define ADC_POT 0
+#define ADC_LDR 1
+#define ADC_NTC 2
+#define ADC_TEMP 3
+#define ADC_CHANNELS 4
+#define ADC_DISCARD 0x80 // slot whose result is thrown away
+
+// ADMUX of each channel : reference (REFS1..0) + input (MUX3..0)
+const uint8_t	adc_admux[ADC_CHANNELS] = {
+	(1 << REFS0) | 0, // RV1 on ADC0, AVcc
+	(1 << REFS0) | 1, // LDR on ADC1, AVcc
+	(1 << REFS0) | 2, // NTC on ADC2, AVcc
+	(1 << REFS1) | (1 << REFS0) | 8, // doc 24.8 : internal sensor on ADC8, 1.1V only
+};
+
+// one scan, one conversion per channel, all on AVcc
+const uint8_t	adc_scan[] = {ADC_POT, ADC_LDR, ADC_NTC};
+#define ADC_SCAN (sizeof(adc_scan))
+
+// the temperature has its own phase every ADC_TEMP_SCANS scans (about 0.3 s) :
+// doc 24.5.2 : after a reference switch AREF takes ms to settle (the capacitor discharges
+// through the internal reference, see TEMP_SETTLE_MS in ex03), those conversions are thrown
+// away, then one 64x value is taken and a few conversions are thrown away back on AVcc.
+// The other channels do not move during the phase, about 27 ms.
+#define ADC_TEMP_SCANS 1000
+#define ADC_TEMP_SETTLE_MS 20
+#define ADC_CONV_RATE (F_CPU / 128 / 13) // conversions per second, 13 ADC clocks each
+#define ADC_TEMP_SETTLE (ADC_TEMP_SETTLE_MS * ADC_CONV_RATE / 1000)
+#define ADC_TEMP_SAMPLES (1 << (2 * ADC_OS_64X))
+#define ADC_AVCC_SETTLE 2
+#define ADC_TEMP_PHASE (ADC_TEMP_SETTLE + ADC_TEMP_SAMPLES + ADC_AVCC_SETTLE)
+
+volatile uint16_t	adc_values[ADC_CHANNELS];
+volatile uint8_t	adc_seq[ADC_CHANNELS]; // + 1 for every new value
+uint8_t				adc_pending[2]; // slot of the conversion that ends in the ISR, then the next one
+uint8_t				adc_scan_pos = 0;
+uint16_t			adc_scans = 0;
+uint16_t			adc_temp_left = 0; // conversions left in the temperature phase, 0 when scanning
+
+/*********************OVERSAMPLING AND FILTERS*************************/
+// 4^n conversions added up and shifted right by n give n more bits (AVR121) :
+// 4x -> 11 bits, 16x -> 12 bits, 64x -> 13 bits (about 12 useful), 64 x 1023 still fits 16 bits
+// then an optional filter, all of it done a sample at a time in the ISR so a read stays O(1)
+#define ADC_OS_1X 0
+#define ADC_OS_4X 1
+#define ADC_OS_16X 2
+#define ADC_OS_64X 3
+#define ADC_FILTER_NONE 0
+#define ADC_FILTER_MA 1 // moving average of the last ADC_MA_LEN values
+#define ADC_FILTER_EMA 2 // exponential, y += (x - y) / 2^ADC_EMA_SHIFT
+#define ADC_MA_SHIFT 3
+#define ADC_MA_LEN (1 << ADC_MA_SHIFT)
+#define ADC_EMA_SHIFT 3
+
+const uint8_t	adc_oversampling[ADC_CHANNELS] = {
+	ADC_OS_16X, // RV1 : 12 bits, steady thresholds
+	ADC_OS_4X, // LDR
+	ADC_OS_4X, // NTC
+	ADC_OS_64X, // internal temperature moves slowly, 1 LSB is about 1 degree
+};
+const uint8_t	adc_filter[ADC_CHANNELS] = {
+	ADC_FILTER_EMA,
+	ADC_FILTER_MA,
+	ADC_FILTER_MA,
+	ADC_FILTER_NONE,
+};
+
+uint16_t	adc_acc[ADC_CHANNELS]; // oversampling sum
+uint8_t		adc_count[ADC_CHANNELS];
+uint16_t	adc_ma[ADC_CHANNELS][ADC_MA_LEN]; // last values, for the moving average
+uint16_t	adc_ma_sum[ADC_CHANNELS];
+uint8_t		adc_ma_pos[ADC_CHANNELS];
+uint16_t	adc_ema[ADC_CHANNELS]; // y * 2^ADC_EMA_SHIFT
+
+// resolution of what adc_read() returns for a channel
+uint8_t	adc_bits(uint8_t channel)
 {
-	// set Voltage reference to AVcc (01)
-	ADMUX &= ~(1 << REFS1);
-	ADMUX |= (1 << REFS0);
+	return (10 + adc_oversampling[channel]);
+}
 
+// called by the ISR for every kept conversion
+void	adc_sample(uint8_t channel, uint16_t value)
+{
+	uint8_t	os = adc_oversampling[channel];
+	uint8_t	pos;
+
+	adc_acc[channel] += value;
+	adc_count[channel]++;
+	if (adc_count[channel] < (1 << (2 * os)))
+		return ;
+	value = adc_acc[channel] >> os; // decimation
+	adc_acc[channel] = 0;
+	adc_count[channel] = 0;
+	if (adc_filter[channel] == ADC_FILTER_MA)
+	{
+		// running sum : add the new value, take out the oldest one
+		pos = adc_ma_pos[channel];
+		adc_ma_sum[channel] += value - adc_ma[channel][pos];
+		adc_ma[channel][pos] = value;
+		adc_ma_pos[channel] = (pos + 1) & (ADC_MA_LEN - 1);
+		value = adc_ma_sum[channel] >> ADC_MA_SHIFT;
+	}
+	else if (adc_filter[channel] == ADC_FILTER_EMA)
+	{
+		adc_ema[channel] += value - (adc_ema[channel] >> ADC_EMA_SHIFT);
+		value = adc_ema[channel] >> ADC_EMA_SHIFT;
+	}
+	adc_values[channel] = value;
+	adc_seq[channel]++;
+}
+
+// slot of the next conversion : the scan, or the temperature phase when it is due
+uint8_t	adc_next()
+{
+	uint8_t	slot;
+
+	if (adc_temp_left)
+	{
+		adc_temp_left--;
+		if (adc_temp_left < ADC_AVCC_SETTLE)
+			return (adc_scan[0] | ADC_DISCARD);
+		if (adc_temp_left < ADC_AVCC_SETTLE + ADC_TEMP_SAMPLES)
+			return (ADC_TEMP);
+		return (ADC_TEMP | ADC_DISCARD);
+	}
+	slot = adc_scan[adc_scan_pos++];
+	if (adc_scan_pos == ADC_SCAN)
+	{
+		adc_scan_pos = 0;
+		if (++adc_scans == ADC_TEMP_SCANS)
+		{
+			adc_scans = 0;
+			adc_temp_left = ADC_TEMP_PHASE;
+		}
+	}
+	return (slot);
+}
+
+// doc 24.5.1 : in free running mode the next conversion has already started with the
+// previous ADMUX when the ISR runs, so the MUX written here is for the one after
+ISR(ADC_vect)
+{
+	uint16_t	value = ADC;
+	uint8_t		slot = adc_pending[0];
+
+	adc_pending[0] = adc_pending[1];
+	adc_pending[1] = adc_next();
+	ADMUX = adc_admux[adc_pending[1] & ~ADC_DISCARD];
+	if (!(slot & ADC_DISCARD))
+		adc_sample(slot, value);
+}
+
+void	adc_init()
+{
 	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
 	ADCSRA |= (1 << ADPS2);
 	ADCSRA |= (1 << ADPS1);
 	ADCSRA |= (1 << ADPS0);
 
-	// Enable ADC (ADEN)
-	ADCSRA |= (1 << ADEN);
+	// doc 24.9.4 - Table 24-6 : trigger source = free running (000)
+	ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));
+	adc_pending[0] = adc_next();
+	ADMUX = adc_admux[adc_pending[0]];
+
+	// Enable ADC (ADEN), auto trigger (ADATE), interrupt (ADIE) and start the first conversion
+	ADCSRA |= (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADSC);
+	// doc 24.5 : MUX can change one ADC clock (8 us) after ADSC, that's the second slot
+	_delay_us(10);
+	adc_pending[1] = adc_next();
+	ADMUX = adc_admux[adc_pending[1]];
+}
+
+// latest value of a channel, seq (if not null) tells if it's a new one
+uint16_t	adc_read(uint8_t channel, uint8_t *seq)
+{
+	uint16_t	value;
 
+	cli();
+	value = adc_values[channel];
+	if (seq)
+		*seq = adc_seq[channel];
+	sei();
+	return (value);
 }
 
 // potentiometer : measures difference of potential 
@@ -102,60 +276,28 @@ void	adc_init()
 
 int	main()
 {
-	uint16_t	adc;
-	adc_init();
-	// choose the wanted pin with 
-	// input channel selection table for the last 4 bits of ADMUX
+	uint8_t	seq;
+	uint8_t	last_seq;
 
 	uart_init();
+	adc_init();
+	sei();
 
+	adc_read(ADC_POT, &last_seq);
 	while (1)
 	{
-
-		// we ant RV1 which is on ADC0 (ADC_POT) (0000)
-		// POTENTIOMETER
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		adc = (ADC); // define which contains 2 bytes (reads 0x78 on 16 bits)
-		uart_printnumber(adc);
+		// RV1 (ADC0), LDR (ADC1) and NTC (ADC2), freshest values of the scan
+		// oversampled : 12 bits for RV1 (0 to 4092), 11 bits for the others
+		// a line for every new RV1 value : 16 scans of 3 conversions, about 5 ms
+		uint16_t	pot = adc_read(ADC_POT, &seq);
+		if (seq == last_seq)
+			continue ;
+		last_seq = seq;
+		uart_printnumber(pot);
 		uart_printstr(", ");
-
-		// we want LDR which is on ADC1 (ADC_) (0001)
-		// LUMINOSITY
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX |= (1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		adc = (ADC);
-		uart_printnumber(adc);
+		uart_printnumber(adc_read(ADC_LDR, 0));
 		uart_printstr(", ");
-
-		// we want NTC which is on ADC2 (ADC_) (0010)
-		// TEMPERATURE
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX |= (1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		adc = (ADC);
-		uart_printnumber(adc);
+		uart_printnumber(adc_read(ADC_NTC, 0));
 		uart_printstr("\r\n");
-		_delay_ms(20);
 	}
 }
\ No newline at end of file
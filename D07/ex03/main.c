@@ -1,5 +1,52 @@
 #include <avr/io.h>
 #include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+// ADC_MODE_SLEEP converts in ADC Noise Reduction sleep, ADC_MODE_BUSY polls ADSC
+#define ADC_MODE_BUSY	0
+#define ADC_MODE_SLEEP	1
+#ifndef ADC_MODE
+# define ADC_MODE	ADC_MODE_SLEEP
+#endif
+#define PRINT_MS	250
+#define BENCH_SAMPLES	256
+
+// doc 24.8 : temperature sensor is ADC8, only valid with the internal 1.1V reference
+#define TEMP_ADMUX		((1 << REFS1) | (1 << REFS0) | (1 << MUX3))
+#define TEMP_SETTLE_MS	20	// AREF capacitor charging through the internal reference
+#define TEMP_SAMPLES	16	// raw readings are summed, so they are in 1/16 LSB
+#define TEMP_CAL_ADDR	0
+#define TEMP_CAL_MAGIC	0x7C
+#define TEMP_CAL_SIZE	6	// gain (4 bytes) + offset (2 bytes), little endian
+#define TEMP_CAL_MIN	(5 * TEMP_SAMPLES)	// two points closer than 5 LSB give a useless gain
+
+// datasheet typical values, 1 LSB per degree and 352 (0x160) at 25 C, in tenths of C
+#define TEMP_DEFAULT_GAIN	(((int32_t)10 << 16) / TEMP_SAMPLES)
+#define TEMP_DEFAULT_OFFSET	(250 - 352 * 10)
+// a calibrated slope has to stay between 1/4 and 3 times the typical one : raw is at most
+// 16 x 1023 < 2^14, so raw * gain stays under 2^31 in temp_convert() up to 131072
+#define TEMP_GAIN_MIN	(TEMP_DEFAULT_GAIN / 4)
+#define TEMP_GAIN_MAX	(TEMP_DEFAULT_GAIN * 3)
+
+#define COMMAND_SIZE	16
+#define WRONG_INPUT "\r\nWrong input, try this format : #CAL1 T, #CAL2 T (T in C like -4.5 or 23), #CALSHOW or #CALRESET\r\n"
+
+volatile uint8_t	adc_done = 0;
+volatile uint8_t	rx_edge = 0;	// RXD moved during a sleeping conversion
+volatile uint16_t	tick_ms = 0;
+uint8_t				uart_pending = 0;
+
+// tenths of C = offset + (raw * gain) >> 16, raw being the sum of TEMP_SAMPLES readings
+int32_t				temp_gain = TEMP_DEFAULT_GAIN;
+int16_t				temp_offset = TEMP_DEFAULT_OFFSET;
+uint16_t			cal_raw = 0;	// first point captured by #CAL1, needed by #CAL2
+int16_t				cal_temp = 0;
+uint8_t				cal_have_point = 0;
+
+volatile char		command[COMMAND_SIZE];
+volatile uint8_t	input_count = 0;
+volatile uint8_t	new_command = 0;
 
 void	uart_init()
 {
@@ -41,8 +88,22 @@ void	 uart_tx(char c)
 	// doc 20.6.3 : checks when transmit buffer is empty
 	while (!(UCSR0A & (1<<UDRE0)))
 	{}
+	// doc 20.11.2 : TXC0 is cleared by writing a one, set again once the frame is out
+	UCSR0A = (1 << TXC0);
 	// doc 20.6.1 : sending frames (5 to 8 bits)
 	UDR0 = c;
+	uart_pending = 1;
+}
+
+// doc 14.3 : ADC Noise Reduction stops clkIO, a frame still shifting out would be
+// stretched and garbled, so the last byte has to be fully sent before sleeping
+void	uart_flush()
+{
+	if (!uart_pending)
+		return ;
+	while (!(UCSR0A & (1 << TXC0)))
+	{}
+	uart_pending = 0;
 }
 
 void	uart_printstr(char *str)
@@ -70,7 +131,7 @@ void uart_printhex(uint8_t byte)
 	//nibble = 4 bits
 }
 
-void	uart_printnumber(uint16_t n)
+void	uart_printnumber(uint32_t n)
 {
 	if (n >= 10)
 	{
@@ -83,10 +144,7 @@ void	uart_printnumber(uint16_t n)
 
 void	adc_init()
 {
-	// doc 24.8 : about temperature sensor
-	// set Voltage reference to Internal 1.1V with external capacitor (11)
-	ADMUX |= (1 << REFS1);
-	ADMUX |= (1 << REFS0);
+	// the reference and the channel are selected by temp_select()
 
 	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
 	ADCSRA |= (1 << ADPS2);
@@ -98,34 +156,470 @@ void	adc_init()
 
 }
 
+ISR(ADC_vect)
+{
+	adc_done = 1;
+}
+
+// doc 15.9.1 - Table 15-8 : timer0 in CTC, one compare match per millisecond
+// it does not count while the CPU sleeps in ADC Noise Reduction (clkIO is off),
+// so every sleeping conversion (~104 us at /128) delays the tick by that much
+ISR(TIMER0_COMPA_vect)
+{
+	tick_ms++;
+}
+
+void	tick_init()
+{
+	TCCR0A = (1 << WGM01);
+	// doc 15.9.2 - Table 15-9 : prescaler 64 -> 250 kHz
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	OCR0A = (F_CPU / 64 / 1000) - 1;
+	TIMSK0 |= (1 << OCIE0A);
+}
+
+uint16_t	tick_now()
+{
+	uint16_t	ms;
+
+	cli();
+	ms = tick_ms;
+	sei();
+	return (ms);
+}
+
+uint16_t	adc_read_busy()
+{
+	// start conversion (measurement)
+	// we'll have to wait the end of transmission on ADSC
+	ADCSRA |= (1 << ADSC); // set to 1 for next measurement
+	while (ADCSRA & (1 << ADSC))
+	{}
+	return (ADC);
+}
+
+// doc 13.2.4 - 13.2.6 : pin change on RXD (PD0 = PCINT16), only enabled while sleeping
+ISR(PCINT2_vect)
+{
+	rx_edge = 1;
+}
+
+// doc 24.6 : ADC Noise Canceler, entering SLEEP_MODE_ADC starts the conversion
+// and ADC_vect wakes the CPU once it is done.
+// doc 10.1 - Table 10-1 : clkIO is off, timer0 and the USART stop and can't wake us, a
+// byte coming in would be lost. A pin change can : the start bit of a byte on RXD wakes
+// the CPU within a few cycles, clkIO runs again well before the middle of the bit where
+// the USART samples it, and the rest of the conversion is waited for awake.
+// Entering the mode again does not restart a conversion in progress.
+uint16_t	adc_read_sleep()
+{
+	uart_flush();
+	adc_done = 0;
+	rx_edge = 0;
+	ADCSRA |= (1 << ADIE);
+	PCIFR = (1 << PCIF2); // an edge from before the sleep, already seen by the USART
+	PCICR |= (1 << PCIE2);
+	set_sleep_mode(SLEEP_MODE_ADC);
+	cli();
+	sleep_enable();
+	while (!adc_done && !rx_edge)
+	{
+		// sei only takes effect after the next instruction, an interrupt
+		// cannot slip between the test and the sleep
+		sei();
+		sleep_cpu();
+		cli();
+	}
+	sleep_disable();
+	sei();
+	PCICR &= ~(1 << PCIE2);
+	while (!adc_done)
+	{}
+	ADCSRA &= ~(1 << ADIE);
+	return (ADC);
+}
+
+uint16_t	adc_read(uint8_t mode)
+{
+	if (mode == ADC_MODE_SLEEP)
+		return (adc_read_sleep());
+	return (adc_read_busy());
+}
+
+#ifdef ADC_BENCH
+// prints value / 100 with two decimals
+void	uart_printfixed(uint32_t value)
+{
+	uart_printnumber(value / 100);
+	uart_tx('.');
+	uart_tx('0' + (value / 10) % 10);
+	uart_tx('0' + value % 10);
+}
+
+// samples are taken relative to the first one so the sum of squares stays
+// small, variance = (sum(d^2) - sum(d)^2 / n) / n
+void	bench_report(char *name, uint16_t first, int32_t sum, uint32_t sumsq)
+{
+	int32_t		mean = (int32_t)first * 100 + sum * 100 / BENCH_SAMPLES;
+	uint32_t	var = (sumsq - (uint32_t)sum * (uint32_t)sum / BENCH_SAMPLES) * 100 / BENCH_SAMPLES;
+
+	uart_printstr(name);
+	uart_printstr(" mean ");
+	uart_printfixed(mean);
+	uart_printstr(" variance ");
+	uart_printfixed(var);
+	uart_printstr(" LSB^2\r\n");
+}
+
+// busy and sleeping reads are interleaved so both see the same temperature
+// drift and the same timer interrupts
+void	adc_bench()
+{
+	uint16_t	first[2];
+	int32_t		sum[2] = {0, 0};
+	uint32_t	sumsq[2] = {0, 0};
+	uint16_t	i = 0;
+	uint8_t		mode;
+	int16_t		d;
+
+	first[ADC_MODE_BUSY] = adc_read(ADC_MODE_BUSY);
+	first[ADC_MODE_SLEEP] = adc_read(ADC_MODE_SLEEP);
+	while (i < BENCH_SAMPLES)
+	{
+		mode = 0;
+		while (mode < 2)
+		{
+			d = adc_read(mode) - first[mode];
+			sum[mode] += d;
+			sumsq[mode] += (int32_t)d * d;
+			mode++;
+		}
+		i++;
+	}
+	bench_report("busy ", first[ADC_MODE_BUSY], sum[ADC_MODE_BUSY], sumsq[ADC_MODE_BUSY]);
+	bench_report("sleep", first[ADC_MODE_SLEEP], sum[ADC_MODE_SLEEP], sumsq[ADC_MODE_SLEEP]);
+}
+#endif
+
 // potentiometer : measures difference of potential 
 // between two points within a circuit 
 
+/*******************************TEMPERATURE*********************************/
+
+void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address and Data Registers */
+	EEAR = uiAddress;
+	EEDR = ucData;
+	// doc 8.6.3 : EEPE has to be set within 4 cycles after EEMPE, no interrupt in between
+	cli();
+	/* Write logical one to EEMPE */
+	EECR |= (1<<EEMPE);
+	/* Start eeprom write by setting EEPE */
+	EECR |= (1<<EEPE);
+	sei();
+}
+
+unsigned char EEPROM_read(unsigned int uiAddress)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address register */
+	EEAR = uiAddress;
+	/* Start eeprom read by writing EERE */
+	EECR |= (1<<EERE);
+	/* Return data from Data Register */
+	return EEDR;
+}
+
+// doc 24.5.2 : after switching to the internal reference the AREF capacitor has
+// to charge and the first conversion may be inaccurate, so wait and throw it away.
+// Nothing to do when ADMUX already points at the sensor.
+void	temp_select()
+{
+	if (ADMUX == TEMP_ADMUX)
+		return ;
+	ADMUX = TEMP_ADMUX;
+	_delay_ms(TEMP_SETTLE_MS);
+	adc_read_busy();
+}
+
+// sum of TEMP_SAMPLES readings (1/16 LSB).
+// While a command is being typed, or a byte has just come in, the reads stay awake :
+// the next bytes follow closely and each one would cut a sleep short anyway.
+uint16_t	temp_raw()
+{
+	uint16_t	sum = 0;
+	uint8_t		i = 0;
+	uint8_t		mode;
+
+	temp_select();
+	while (i < TEMP_SAMPLES)
+	{
+		mode = ADC_MODE;
+		if (input_count || rx_edge || (UCSR0A & (1 << RXC0)))
+			mode = ADC_MODE_BUSY;
+		sum += adc_read(mode);
+		i++;
+	}
+	return (sum);
+}
+
+int16_t	temp_convert(uint16_t raw)
+{
+	return (temp_offset + (int16_t)(((int32_t)raw * temp_gain) >> 16));
+}
+
+// tenths of a degree C
+int16_t	temp_read()
+{
+	return (temp_convert(temp_raw()));
+}
+
+uint8_t	temp_cal_byte(uint8_t i)
+{
+	if (i < 4)
+		return ((uint32_t)temp_gain >> (8 * i));
+	return ((uint16_t)temp_offset >> (8 * (i - 4)));
+}
+
+// magic, gain, offset, then the sum of those 6 bytes
+void	temp_cal_save()
+{
+	uint8_t	sum = 0;
+	uint8_t	i = 0;
+
+	EEPROM_write(TEMP_CAL_ADDR, TEMP_CAL_MAGIC);
+	while (i < TEMP_CAL_SIZE)
+	{
+		EEPROM_write(TEMP_CAL_ADDR + 1 + i, temp_cal_byte(i));
+		sum += temp_cal_byte(i);
+		i++;
+	}
+	EEPROM_write(TEMP_CAL_ADDR + 1 + TEMP_CAL_SIZE, sum);
+}
+
+// keeps the datasheet defaults if the EEPROM was never calibrated or is corrupted
+void	temp_cal_load()
+{
+	uint8_t		bytes[TEMP_CAL_SIZE];
+	uint8_t		sum = 0;
+	uint8_t		i = 0;
+	int32_t		gain;
+
+	if (EEPROM_read(TEMP_CAL_ADDR) != TEMP_CAL_MAGIC)
+		return ;
+	while (i < TEMP_CAL_SIZE)
+	{
+		bytes[i] = EEPROM_read(TEMP_CAL_ADDR + 1 + i);
+		sum += bytes[i];
+		i++;
+	}
+	if (EEPROM_read(TEMP_CAL_ADDR + 1 + TEMP_CAL_SIZE) != sum)
+		return ;
+	gain = (int32_t)((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8)
+		| ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+	if (gain < TEMP_GAIN_MIN || gain > TEMP_GAIN_MAX) // saved by an older firmware
+		return ;
+	temp_gain = gain;
+	temp_offset = (int16_t)(bytes[4] | (bytes[5] << 8));
+}
+
+void	temp_init()
+{
+	temp_select();
+	temp_cal_load();
+}
+
+// first point : shifts the offset so the current reading gives the reference,
+// on its own it is a one point (offset only) calibration
+void	temp_cal_point1(int16_t reference)
+{
+	cal_raw = temp_raw();
+	cal_temp = reference;
+	cal_have_point = 1;
+	temp_offset += reference - temp_convert(cal_raw);
+	temp_cal_save();
+}
+
+// second point : gain from the slope between both points, then the offset
+// that puts the first point back on its reference
+uint8_t	temp_cal_point2(int16_t reference)
+{
+	uint16_t	raw = temp_raw();
+	int16_t		span = raw - cal_raw;
+	int32_t		gain;
+
+	if (!cal_have_point || (span < TEMP_CAL_MIN && span > -TEMP_CAL_MIN))
+		return (0);
+	gain = ((int32_t)(reference - cal_temp) << 16) / span;
+	if (gain < TEMP_GAIN_MIN || gain > TEMP_GAIN_MAX) // wrong reference or swapped points
+		return (0);
+	temp_gain = gain;
+	temp_offset = 0;
+	temp_offset = cal_temp - temp_convert(cal_raw);
+	temp_cal_save();
+	return (1);
+}
+
+void	temp_cal_reset()
+{
+	temp_gain = TEMP_DEFAULT_GAIN;
+	temp_offset = TEMP_DEFAULT_OFFSET;
+	cal_have_point = 0;
+	EEPROM_write(TEMP_CAL_ADDR, 0xFF);
+}
+
+void	uart_printtenths(int16_t t)
+{
+	if (t < 0)
+	{
+		uart_tx('-');
+		t = -t;
+	}
+	uart_printnumber(t / 10);
+	uart_tx('.');
+	uart_tx('0' + t % 10);
+}
+
+/*********************************COMMANDS**********************************/
+
+// libC AVR function for interrupts
+// only buffers the line, the command needs ADC reads and EEPROM writes so it
+// is run from the main loop
+ISR(USART_RX_vect)
+{
+	char	c = UDR0;
+
+	if (new_command)
+		return ;
+	uart_tx(c);
+	if (c == '\r') // newline detected
+	{
+		command[input_count] = '\0';
+		new_command = 1;
+		return ;
+	}
+	if (input_count < COMMAND_SIZE - 1)
+		command[input_count++] = c;
+}
+
+// "23", "-4.5" or "+30.2" in tenths of C, 1 if the whole string was a number
+uint8_t	parse_tenths(volatile char *str, int16_t *value)
+{
+	int16_t	t = 0;
+	int8_t	sign = 1;
+	uint8_t	digits = 0;
+
+	if (*str == '-' || *str == '+')
+	{
+		if (*str == '-')
+			sign = -1;
+		str++;
+	}
+	while (*str >= '0' && *str <= '9' && digits < 3)
+	{
+		t = t * 10 + (*str++ - '0');
+		digits++;
+	}
+	t *= 10;
+	if (*str == '.' && str[1] >= '0' && str[1] <= '9')
+	{
+		t += str[1] - '0';
+		str += 2;
+	}
+	*value = t * sign;
+	return (digits && *str == '\0');
+}
+
+uint8_t	command_is(volatile char *str, char *ref)
+{
+	while (*ref)
+	{
+		if (*str++ != *ref++)
+			return (0);
+	}
+	return (1);
+}
+
+void	print_calibration()
+{
+	uart_printstr("\ngain ");
+	if (temp_gain < 0)
+	{
+		uart_tx('-');
+		uart_printnumber(-temp_gain);
+	}
+	else
+		uart_printnumber(temp_gain);
+	uart_printstr("/65536 tenths per 1/16 LSB, offset ");
+	uart_printtenths(temp_offset);
+	uart_printstr(" C\r\n");
+}
+
+void	run_command()
+{
+	int16_t	reference;
+
+	if (command_is(command, "#CALSHOW") && command[8] == '\0')
+		print_calibration();
+	else if (command_is(command, "#CALRESET") && command[9] == '\0')
+	{
+		temp_cal_reset();
+		uart_printstr("\nCalibration back to datasheet defaults\r\n");
+	}
+	else if (command_is(command, "#CAL1 ") && parse_tenths(command + 6, &reference))
+	{
+		temp_cal_point1(reference);
+		uart_printstr("\nFirst point saved, now bring the chip to another temperature for #CAL2\r\n");
+	}
+	else if (command_is(command, "#CAL2 ") && parse_tenths(command + 6, &reference))
+	{
+		if (temp_cal_point2(reference))
+			print_calibration();
+		else
+			uart_printstr("\nNeed #CAL1 first, at least 5 degrees between both points and between 0.25 and 3 degrees per LSB\r\n");
+	}
+	else
+		uart_printstr(WRONG_INPUT);
+}
+
 int	main()
 {
-	uint16_t	adc;
+	uint16_t	last = 0;
 	adc_init();
 	// choose the wanted pin with 
 	// input channel selection table for the last 4 bits of ADMUX
 
 	uart_init();
+	tick_init();
+	sei();
+	// doc 20.11.3 : RX complete interrupt enable
+	UCSR0B |= (1 << RXCIE0);
+	PCMSK2 |= (1 << PCINT16); // RXD, see adc_read_sleep()
+
+	// INTERNAL TEMPERATURE on ADC8 (1000) with the 1.1V reference
+	temp_init();
+#ifdef ADC_BENCH
+	adc_bench();
+#endif
 
 	while (1)
 	{
-		// we want NTC which is on ADC8 (ADC_) (1000)
-		// INTERNAL TEMPERATURE
-		ADMUX |= (1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		adc = ((ADC * 25) / 314);
-		uart_printnumber(adc);
+		if (new_command)
+		{
+			run_command();
+			cli();
+			input_count = 0;
+			new_command = 0;
+			sei();
+		}
+		if ((uint16_t)(tick_now() - last) < PRINT_MS)
+			continue ;
+		last += PRINT_MS;
+		uart_printtenths(temp_read());
 		uart_printstr("\r\n");
-		_delay_ms(20);
 	}
 }
\ No newline at end of file
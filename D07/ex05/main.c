@@ -0,0 +1,183 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+/*********************INTRODUCTION*************************/
+// fixed rate sampling : timer1 compare match B starts every conversion through the
+// ADC auto trigger, so the samples are evenly spaced whatever the main loop does
+// the samples go through a ring buffer and leave on the UART in binary blocks :
+// 0xA5, 0x5A, block number, lost samples (16 bits), BLOCK_SAMPLES samples (16 bits),
+// CRC16 (xmodem) of everything after the sync bytes, all little endian
+// make SAMPLE_RATE=5000 for 5 kHz, the UART runs at 500 kbauds to keep up with 10 kHz
+
+#ifndef SAMPLE_RATE
+# define SAMPLE_RATE 1000
+#endif
+#if SAMPLE_RATE < 100 || SAMPLE_RATE > 10000
+# error "SAMPLE_RATE must be between 100 and 10000 Hz"
+#endif
+#ifndef SAMPLE_CHANNEL
+# define SAMPLE_CHANNEL 0 // RV1 on ADC0
+#endif
+#define RING_SIZE 256 // samples, uint8_t indexes wrap on their own
+#define BLOCK_SAMPLES 32
+
+void	uart_init()
+{
+	// UART config to 8N1 (8-bit, no parity, stop-bit = 1)
+	// doc 20.6 : enable transmitter 0
+	// doc 20.7 : enable receiver 0
+	UCSR0B |= (1 << TXEN0);
+	UCSR0B |= (1 << RXEN0);
+
+	// doc 20.11.4 - Table 20-8 : async mode chosen caue asked for "UART" with no S 00
+	UCSR0C &= ~(1 << UMSEL01);
+	UCSR0C &= ~(1 << UMSEL00);
+
+	// doc 20.11.4 - Table 20-9 : parity mode (checks of parity) = none 00
+	UCSR0C &= ~(1 << UPM01);
+	UCSR0C &= ~(1 << UPM00);
+
+	// doc 20.11.4 - Table 20-10 : stop bit select = one (bit set to 0)
+	UCSR0C &= ~(1 << USBS0);
+
+	// doc 20.11.4 - Table 20-11 : character size = 8-bit (011)
+	UCSR0C &= ~(1 << UCSZ02);
+	UCSR0C |= (1 << UCSZ01);
+	UCSR0C |= (1 << UCSZ00);
+
+	// doc 20.11.4 - Table 20-12 : clock plarity for sync mode only, set to 0 for async
+	UCSR0C &= ~(1 << UCPOL0);
+
+	// doc 20.3.1 - Table 20-1 : baudrate or UBRRn calculation
+	// doc 20.11.5 : USART baud rate set with UBRRnH-L
+	// UBRRn = (F_CPU / 8 * BAUD) - 1
+	UBRR0L = (float)((F_CPU / (16.0 * UART_BAUDRATE) + 0.5)) - 1;
+	UBRR0H = 0;
+}
+
+void	 uart_tx(char c)
+{
+	// doc 20.6.2 example of code
+	// doc 20.6.3 : checks when transmit buffer is empty
+	while (!(UCSR0A & (1<<UDRE0)))
+	{}
+	// doc 20.6.1 : sending frames (5 to 8 bits)
+	UDR0 = c;
+}
+
+/*********************SAMPLING*************************/
+uint16_t			ring[RING_SIZE];
+volatile uint8_t	ring_head = 0; // written by the ISR
+volatile uint8_t	ring_tail = 0; // written by the main loop
+volatile uint16_t	lost = 0; // samples dropped because the ring was full
+
+void	timer1_init()
+{
+	// doc 16.11.1 - Table 16-4 : CTC with TOP = OCR1A (0100)
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12);
+	// prescaler 8 -> 2 MHz, one period = 2 MHz / SAMPLE_RATE ticks
+	OCR1A = (F_CPU / 8 / SAMPLE_RATE) - 1;
+	// compare match B at the end of the period is the ADC trigger
+	OCR1B = OCR1A;
+	TCCR1B |= (1 << CS11);
+}
+
+void	adc_init()
+{
+	// set Voltage reference to AVcc (01), input = SAMPLE_CHANNEL
+	ADMUX = (1 << REFS0) | SAMPLE_CHANNEL;
+
+	// a conversion takes 13.5 ADC clocks when auto triggered (doc 24.4)
+#if SAMPLE_RATE > 5000
+	// prescaler 64 : 250 kHz, up to 18k samples per second
+	ADCSRA |= (1 << ADPS2);
+	ADCSRA |= (1 << ADPS1);
+#else
+	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
+	ADCSRA |= (1 << ADPS2);
+	ADCSRA |= (1 << ADPS1);
+	ADCSRA |= (1 << ADPS0);
+#endif
+
+	// doc 24.9.4 - Table 24-6 : trigger source = timer1 compare match B (101)
+	ADCSRB = (1 << ADTS2) | (1 << ADTS0);
+
+	// Enable ADC (ADEN), auto trigger (ADATE) and interrupt (ADIE)
+	ADCSRA |= (1 << ADEN) | (1 << ADATE) | (1 << ADIE);
+}
+
+// doc 24.3 : the trigger is the rising edge of OCF1B, nothing else clears it
+// (no TIMER1_COMPB ISR) so it's cleared here to get the next edge
+ISR(ADC_vect)
+{
+	uint16_t	value = ADC;
+	uint8_t		next = ring_head + 1;
+
+	TIFR1 = (1 << OCF1B);
+	if (next == ring_tail)
+	{
+		lost++;
+		return ;
+	}
+	ring[ring_head] = value;
+	ring_head = next;
+}
+
+/*********************STREAMING*************************/
+uint16_t	crc = 0;
+
+void	block_tx(uint8_t c)
+{
+	crc = _crc_xmodem_update(crc, c);
+	uart_tx(c);
+}
+
+void	send_block(uint8_t number)
+{
+	uint16_t	dropped;
+	uint16_t	sample;
+	uint8_t		i = 0;
+
+	cli();
+	dropped = lost;
+	lost = 0;
+	sei();
+	uart_tx(0xA5);
+	uart_tx(0x5A);
+	crc = 0;
+	block_tx(number);
+	block_tx(dropped);
+	block_tx(dropped >> 8);
+	while (i < BLOCK_SAMPLES)
+	{
+		sample = ring[ring_tail];
+		ring_tail = ring_tail + 1;
+		block_tx(sample);
+		block_tx(sample >> 8);
+		i++;
+	}
+	sample = crc;
+	uart_tx(sample);
+	uart_tx(sample >> 8);
+}
+
+int	main()
+{
+	uint8_t	number = 0;
+
+	uart_init();
+	adc_init();
+	timer1_init();
+	sei();
+
+	while (1)
+	{
+		// ring_head only moves forward, a stale read just means waiting one more pass
+		if ((uint8_t)(ring_head - ring_tail) >= BLOCK_SAMPLES)
+		{
+			send_block(number);
+			number++;
+		}
+	}
+}
\ No newline at end of file
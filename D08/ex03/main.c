@@ -87,15 +87,88 @@ void	set_led6(uint8_t l, uint8_t r, uint8_t g, uint8_t b)
 	set_one_led(0b11100000, 0x0, 0x0, 0x0);
 }
 
-uint16_t	adc = 0;
+/*********************FRAMEBUFFER*************************/
+// the loop runs as fast as the ADC, the frame only goes on the bus when a LED changed
+#define LED_COUNT 3
+uint8_t		leds[LED_COUNT][4]; // brightness, r, g, b
+uint8_t		leds_dirty = 1;
 
-void	SPI_lights_off()
+void	leds_set(uint8_t led, uint8_t l, uint8_t r, uint8_t g, uint8_t b)
+{
+	if (leds[led][0] == l && leds[led][1] == r && leds[led][2] == g && leds[led][3] == b)
+		return ;
+	leds[led][0] = l;
+	leds[led][1] = r;
+	leds[led][2] = g;
+	leds[led][3] = b;
+	leds_dirty = 1;
+}
+
+void	leds_show()
 {
+	int	i = 0;
+	if (!leds_dirty)
+		return ;
 	start_frame();
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
+	while (i < LED_COUNT)
+	{
+		set_one_led(leds[i][0], leds[i][1], leds[i][2], leds[i][3]);
+		i++;
+	}
 	end_frame();
+	leds_dirty = 0;
+}
+
+/*********************BAND QUANTIZER*************************/
+// maps the potentiometer to a band with hysteresis : the value has to go hyst
+// past an edge to change band, so a reading sitting on a boundary doesn't make
+// the output flicker. band_update() only returns 1 on a real transition.
+#define BAND_NONE	0xFF
+#define BAND_HYST	8	// ADC LSB, a bit more than the potentiometer noise
+// lower edge of the band above "percent" of the ADC range, same rounding as adc > 1023 * 0.xx
+#define BAND_EDGE(percent)	((uint16_t)(1023UL * (percent) / 100 + 1))
+
+typedef struct	s_bands
+{
+	const uint16_t	*edges;	// lower edge of bands 1 to count - 1, increasing
+	uint8_t			count;
+	uint8_t			hyst;
+	uint8_t			band;	// current band, BAND_NONE before the first value
+}	t_bands;
+
+uint8_t	band_update(t_bands *q, uint16_t value)
+{
+	uint8_t	band = q->band;
+
+	if (band == BAND_NONE) // first value, no previous band to stick to
+	{
+		band = 0;
+		while (band + 1 < q->count && value >= q->edges[band])
+			band++;
+	}
+	else
+	{
+		while (band + 1 < q->count && value >= q->edges[band] + q->hyst)
+			band++;
+		while (band > 0 && value + q->hyst < q->edges[band - 1])
+			band--;
+	}
+	if (band == q->band)
+		return (0);
+	q->band = band;
+	return (1);
+}
+
+const uint16_t	pot_edges[] = {BAND_EDGE(1), BAND_EDGE(33), BAND_EDGE(66)};
+t_bands			pot_bands = {pot_edges, 4, BAND_HYST, BAND_NONE};
+uint16_t		adc = 0;
+
+void	SPI_lights_off()
+{
+	leds_set(0, 0b11100000, 0x0, 0x0, 0x0);
+	leds_set(1, 0b11100000, 0x0, 0x0, 0x0);
+	leds_set(2, 0b11100000, 0x0, 0x0, 0x0);
+	leds_show();
 }
 
 int	main()
@@ -118,34 +191,23 @@ int	main()
 		{}
 		adc = (ADC);
 
-		if ((adc < (1023 * 0.01)))
+		if (!band_update(&pot_bands, adc))
+			continue ;
+		if (pot_bands.band == 0)
 			SPI_lights_off();
-		else if ((adc > (1023 * 0.01)) && (adc <= (1023 * 0.33)))
-		{
-			/******LED D6*****/
-			start_frame();
-			set_one_led(0b11100001, 0xFF, 0x0, 0x0); // LED 6
-			set_one_led(0b11100000, 0x0, 0x0, 0x0);
-			set_one_led(0b11100000, 0x0, 0x0, 0x0);
-			end_frame();
-		}
-		else if ((adc > (1023 * 0.33)) && (adc <= (1023 * 0.66)))
-		{
-			/******LED D6*****/
-			start_frame();
-			set_one_led(0b11100001, 0xFF, 0x0, 0x0); // LED 6
-			set_one_led(0b11100001, 0x0, 0xFF, 0x0); // LED 7
-			set_one_led(0b11100000, 0x0, 0x0, 0x0);
-			end_frame();
-		}
 		else
 		{
-			/******LED D6*****/
-			start_frame();
-			set_one_led(0b11100001, 0xFF, 0x0, 0x0); // LED 6
-			set_one_led(0b11100001, 0x0, 0xFF, 0x0); // LED 7
-			set_one_led(0b11100001, 0x0, 0x0, 0xFF); // LED 8
-			end_frame();
+			/******LED D6 D7 D8 : one more per band*****/
+			leds_set(0, 0b11100001, 0xFF, 0x0, 0x0); // LED 6
+			if (pot_bands.band >= 2)
+				leds_set(1, 0b11100001, 0x0, 0xFF, 0x0); // LED 7
+			else
+				leds_set(1, 0b11100000, 0x0, 0x0, 0x0);
+			if (pot_bands.band >= 3)
+				leds_set(2, 0b11100001, 0x0, 0x0, 0xFF); // LED 8
+			else
+				leds_set(2, 0b11100000, 0x0, 0x0, 0x0);
+			leds_show();
 		}
 	}
 }
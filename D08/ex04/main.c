@@ -2,6 +2,7 @@
 #include <util/delay.h>
 #include <avr/interrupt.h>
 #include <stdbool.h>
+#include <avr/pgmspace.h>
 /*********************INTRODUCTION*************************/
 // doc 19.2
 // Serial Peripheral Interface (SPI) = llows high-speed synchronous data transfer between the
@@ -36,6 +37,17 @@ void	uart_printstr(char *str)
 	}
 }
 
+void	uart_printnumber(uint32_t n)
+{
+	if (n >= 10)
+	{
+		uart_printnumber(n / 10);
+		uart_printnumber(n % 10);
+	}
+	else
+		uart_tx(n + '0');
+}
+
 void	uart_init()
 {
 	// UART config to 8N1 (8-bit, no parity, stop-bit = 1)
@@ -86,6 +98,56 @@ void	adc_init()
 
 }
 
+/*********************SPI CLOCK PROFILES*************************/
+// doc 19.5.2 - Table 19-5 : SCK = fck / divider, picked with SPR1:0 (SPCR) and SPI2X (SPSR)
+// SPI2X SPR1 SPR0 : 000 fck/4   001 fck/16  010 fck/64  011 fck/128
+//                   100 fck/2   101 fck/8   110 fck/32  111 fck/64
+#define SPI_SPR(div) (((div) == 2 || (div) == 4) ? 0 \
+	: ((div) == 8 || (div) == 16) ? (1 << SPR0) \
+	: ((div) == 32 || (div) == 64) ? (1 << SPR1) \
+	: ((1 << SPR1) | (1 << SPR0)))
+#define SPI_2X(div) (((div) == 2 || (div) == 8 || (div) == 32) ? (1 << SPI2X) : 0)
+#define SPI_DIV_OK(div) ((div) == 2 || (div) == 4 || (div) == 8 || (div) == 16 \
+	|| (div) == 32 || (div) == 64 || (div) == 128)
+
+#ifndef SPI_DEFAULT_DIV
+# define SPI_DEFAULT_DIV 16 // 1 MHz, what SPI_MasterInit always used
+#endif
+// the LEDs have two profiles : short frames are polled at SPI_LEDS_DIV, at fck/2 a byte
+// takes 16 cycles, less than the ISR would cost. Long frames go in the background at
+// SPI_LEDS_ISR_DIV, the divider has to leave the CPU time between two SPI_STC_vect :
+// the ISR and its frame_byte() call are about 80 cycles, at fck/32 a byte is 256 cycles
+#ifndef SPI_LEDS_DIV
+# define SPI_LEDS_DIV 2 // 8 MHz, the APA102 is fine way above that
+#endif
+#ifndef SPI_LEDS_ISR_DIV
+# define SPI_LEDS_ISR_DIV 32 // 500 kHz, the ISR takes about a third of the CPU
+#endif
+#if !SPI_DIV_OK(SPI_DEFAULT_DIV) || !SPI_DIV_OK(SPI_LEDS_DIV) || !SPI_DIV_OK(SPI_LEDS_ISR_DIV)
+# error "SPI clock divider must be 2, 4, 8, 16, 32, 64 or 128"
+#endif
+
+// one profile per device on the bus : SPR1:0 bits and SPI2X bit
+#define SPI_DEV_DEFAULT 0
+#define SPI_DEV_LEDS 1
+#define SPI_DEV_LEDS_ISR 2
+uint8_t	spi_profiles[][2] = {
+	{SPI_SPR(SPI_DEFAULT_DIV), SPI_2X(SPI_DEFAULT_DIV)},
+	{SPI_SPR(SPI_LEDS_DIV), SPI_2X(SPI_LEDS_DIV)},
+	{SPI_SPR(SPI_LEDS_ISR_DIV), SPI_2X(SPI_LEDS_ISR_DIV)},
+};
+uint8_t	spi_device = SPI_DEV_DEFAULT;
+
+// only call it while the bus is idle, the clock would change in the middle of a byte
+void	SPI_select(uint8_t dev)
+{
+	if (dev == spi_device)
+		return ;
+	SPCR = (SPCR & ~((1 << SPR1) | (1 << SPR0))) | spi_profiles[dev][0];
+	SPSR = spi_profiles[dev][1]; // SPI2X is the only writable bit of SPSR
+	spi_device = dev;
+}
+
 void SPI_MasterInit(void)
 {
 /* Set MOSI and SCK output, all others input */
@@ -93,14 +155,18 @@ void SPI_MasterInit(void)
 	// DDB3 instead of PB3 which controls the pull-up for MOSI
 	// DDB2 = SS pin
 	DDRB = (1 << DDB3) | (1 << DDB2) |(1 << DDB5);
-	/* Enable SPI, Master, set clock rate fck/16 */
+	/* Enable SPI, Master, clock rate from the default profile */
 	// SPE = enable SPI
 	// MSTR = set as master
-	// SPR0 = set clock rate
-	SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR0);
+	SPCR = (1<<SPE) | (1<<MSTR) | spi_profiles[SPI_DEV_DEFAULT][0];
+	SPSR = spi_profiles[SPI_DEV_DEFAULT][1];
+	spi_device = SPI_DEV_DEFAULT;
 }
+
+// any other device of the bus, with no LED transfer running (leds_wait())
 void SPI_MasterTransmit(char cData)
 {
+	SPI_select(SPI_DEV_DEFAULT);
 	/* Start transmission */
 	SPDR = cData;
 	/* Wait for transmission complete */
@@ -114,58 +180,341 @@ uint8_t SPI_Receive(void)
     return SPDR;
 }
 
-void	set_one_led(uint8_t l, uint8_t r, uint8_t g, uint8_t b)
+/*********************APA102 DRIVER*************************/
+// one LED frame on the wire = 111 + 5 bits global brightness, then B, G, R
+// the whole strip lives in SRAM (4 bytes per LED) and leds_show() streams it
+#ifndef LED_COUNT
+# define LED_COUNT 3 // D6, D7, D8 on the board, override with -DLED_COUNT for a strip
+#endif
+#define LED_BYTES 4
+#define LED_OFF 0b11100000 // 3 first neutral (1s) and global brightness 0
+// the data is delayed by half a clock per LED along the chain, so the end frame
+// needs n / 2 more clock edges : 1 byte = 8 edges = 16 LEDs (min 4 bytes)
+#define END_FRAME_BYTES(n) ((((n) + 15) / 16) < 4 ? 4 : (((n) + 15) / 16))
+
+#define START_FRAME_BYTES 4
+#define FRAME_BYTES(n) (START_FRAME_BYTES + (n) * LED_BYTES + END_FRAME_BYTES(n))
+#ifndef LED_POLL_BYTES
+# define LED_POLL_BYTES 64 // up to 14 LEDs, about 100 us at fck/2
+#endif
+
+// leds = buffer the application draws into
+// with -DLED_DOUBLE_BUFFER a second buffer is clocked out by the ISR while the
+// next frame is drawn, otherwise drawing waits for the transfer to be over
+#ifdef LED_DOUBLE_BUFFER
+uint8_t				led_buffers[2][LED_COUNT * LED_BYTES];
+uint8_t				*leds = led_buffers[0];
+#else
+uint8_t				leds[LED_COUNT * LED_BYTES];
+#endif
+uint8_t * volatile	leds_tx = 0; // buffer being clocked out
+volatile uint16_t	leds_tx_pos = 0;
+volatile uint16_t	leds_tx_bytes = 0; // LED bytes in the transfer
+volatile uint16_t	leds_tx_end = 0; // whole transfer, start and end frames included
+volatile uint8_t	leds_done = 1; // completion flag, set by the ISR after the end frame
+// generation of the framebuffer, bumped by every write that changes a byte :
+// leds_show() skips the transfer when the strip already shows that generation
+uint16_t			leds_gen = 1;
+uint16_t			leds_shown_gen = 0;
+uint32_t			leds_pushed = 0;
+uint32_t			leds_skipped = 0;
+
+// byte n of the whole frame : start frame (0x00), LED frames, end frame (0xFF)
+uint8_t	frame_byte(uint16_t n)
+{
+	if (n < START_FRAME_BYTES)
+		return (0b0);
+	n -= START_FRAME_BYTES;
+	if (n < leds_tx_bytes)
+		return (leds_tx[n]);
+	return (0b11111111);
+}
+
+#ifdef LED_USART_SPI
+/*********************USART IN SPI MODE (MSPIM) BACKEND*************************/
+// make DEFS=-DLED_USART_SPI : the strip is on TXD0 (PD1, data) and XCK0 (PD4, clock)
+// and the hardware SPI port stays free for other peripherals
+// doc 21.1 : unlike SPDR, the transmit buffer is double buffered, the next byte is
+// written while the current one is shifted out so the frame has no gap between bytes
+// as long as the ISR is faster than one byte : 8 SCK = 16 * (UBRR0 + 1) cycles
+# if defined(SPI_BENCH) || defined(HSV_BENCH)
+#  error "the benchmarks print on the UART, they can't run with LED_USART_SPI"
+# endif
+# ifndef LED_USART_UBRR
+#  define LED_USART_UBRR 3 // doc 21.3.1 : baud = fck / (2 * (UBRR0 + 1)) = 2 MHz
+# endif
+
+void	leds_usart_init()
 {
-	SPI_MasterTransmit(l); // 3 first neutral (1s) and 5 bits for global brightness
-	SPI_MasterTransmit(b);
-	SPI_MasterTransmit(g);
-	SPI_MasterTransmit(r);
+	// doc 21.3 : UBRR0 has to be 0 when the transmitter is enabled
+	UBRR0 = 0;
+	// XCK0 as output = master mode
+	DDRD |= (1 << DDD4);
+	DDRD |= (1 << DDD1);
+	// doc 21.5.3 : UMSEL0 = 11 for MSPIM, UCPOL0 = UCPHA0 = 0 for SPI mode 0 like the APA102
+	// wants, UDORD0 = 0 for MSB first
+	UCSR0C = (1 << UMSEL01) | (1 << UMSEL00);
+	// transmit only, nothing comes back from the strip
+	UCSR0B = (1 << TXEN0);
+	UBRR0 = LED_USART_UBRR;
 }
 
-void	start_frame()
+// doc 21.4 : UDRE0 is set as soon as the transmit buffer can take a byte, fill it
+// while there is room (up to 2 bytes : buffer + shift register)
+ISR(USART_UDRE_vect)
 {
-	int	i = 0;
-	while (i < 4) // START FRAME
+	uint16_t	pos = leds_tx_pos;
+	uint16_t	end = leds_tx_end;
+	while ((UCSR0A & (1 << UDRE0)) && pos != end)
+	{
+		if (pos == end - 1)
+			UCSR0A = (1 << TXC0); // written 1 to clear, a late ISR may have set TXC0 mid-frame, only the last byte counts
+		UDR0 = frame_byte(pos);
+		pos++;
+	}
+	leds_tx_pos = pos;
+	if (pos == end)
+	{
+		// everything is queued, wait for the shift register to be empty
+		UCSR0B &= ~(1 << UDRIE0);
+		UCSR0B |= (1 << TXCIE0);
+	}
+}
+
+ISR(USART_TX_vect)
+{
+	UCSR0B &= ~(1 << TXCIE0);
+	leds_done = 1;
+}
+#else
+// doc 19.5.1 : SPIF is set when a transfer is complete and fires SPI_STC_vect if SPIE is set,
+// the flag is cleared by hardware when the vector runs so the ISR only has to feed SPDR
+ISR(SPI_STC_vect)
+{
+	uint16_t	pos = leds_tx_pos;
+	if (pos == leds_tx_end)
 	{
-		SPI_MasterTransmit(0b0);
+		SPCR &= ~(1 << SPIE); // back to polling for SPI_MasterTransmit once idle
+		leds_done = 1;
+		return ;
+	}
+	SPDR = frame_byte(pos);
+	leds_tx_pos = pos + 1;
+}
+#endif
+
+void	leds_wait()
+{
+	while (!leds_done)
+	{}
+}
+
+void	leds_set(uint16_t led, uint8_t l, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t	*frame;
+
+	if (led >= LED_COUNT)
+		return ;
+	frame = &leds[led * LED_BYTES];
+	if (frame[0] == l && frame[1] == b && frame[2] == g && frame[3] == r)
+		return ;
+#ifndef LED_DOUBLE_BUFFER
+	leds_wait(); // single buffer : don't tear the frame being sent
+#endif
+	leds_gen++;
+	frame[0] = l;
+	frame[1] = b;
+	frame[2] = g;
+	frame[3] = r;
+}
+
+void	leds_fill(uint8_t l, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint16_t	i = 0;
+	while (i < LED_COUNT)
+	{
+		leds_set(i, l, r, g, b);
 		i++;
 	}
 }
 
-void	end_frame()
+void	leds_clear()
 {
-	int	i = 0;
-	while (i < 4) // END FRAME
+	leds_fill(LED_OFF, 0x0, 0x0, 0x0);
+}
+
+// clocks out the first count LEDs of the buffer, in the background unless the frame is short
+void	leds_send(uint8_t *buffer, uint16_t count)
+{
+#ifndef LED_USART_SPI
+	uint16_t	pos = 0;
+#endif
+
+	leds_tx = buffer;
+	leds_tx_bytes = count * LED_BYTES;
+	leds_tx_end = FRAME_BYTES(count);
+	leds_done = 0;
+#ifdef LED_USART_SPI
+	leds_tx_pos = 0;
+	UCSR0B |= (1 << UDRIE0); // the buffer is empty, the ISR fires right away
+#else
+	if (leds_tx_end <= LED_POLL_BYTES)
 	{
-		SPI_MasterTransmit(0b11111111);
+		SPI_select(SPI_DEV_LEDS);
+		while (pos < leds_tx_end)
+		{
+			SPDR = frame_byte(pos);
+			pos++;
+			while (!(SPSR & (1 << SPIF)))
+			{}
+		}
+		leds_done = 1;
+		return ;
+	}
+	SPI_select(SPI_DEV_LEDS_ISR);
+	leds_tx_pos = 1;
+	SPCR |= (1 << SPIE);
+	SPDR = frame_byte(0); // the first byte kicks the transfer, the ISR does the rest
+#endif
+}
+
+// starts clocking out the frame and returns right away (once it's sent for a short one),
+// leds_done tells when it's over
+void	leds_show()
+{
+	uint8_t	*frame = leds;
+
+	if (leds_gen == leds_shown_gen)
+	{
+		leds_skipped++;
+		return ;
+	}
+	leds_shown_gen = leds_gen;
+	leds_pushed++;
+	leds_wait();
+#ifdef LED_DOUBLE_BUFFER
+	// flip : the ISR reads the frame just drawn, the next one starts from a copy of it
+	if (leds == led_buffers[0])
+		leds = led_buffers[1];
+	else
+		leds = led_buffers[0];
+	uint16_t	i = 0;
+	while (i < LED_COUNT * LED_BYTES)
+	{
+		leds[i] = frame[i];
 		i++;
 	}
+#endif
+	leds_send(frame, LED_COUNT);
+}
+
+/*********************COLOUR PIPELINE*************************/
+// 8-bit colours go through a gamma 2.2 curve into a 13-bit intensity (0 to 31 * 255),
+// which is split between the 5-bit global brightness and the 8-bit PWM of each channel :
+// the global level is the smallest one that fits the brightest channel, so dark colours
+// keep the full 8-bit resolution of the PWM instead of a few coarse steps
+// round(7905 * (i / 255) ^ 2.2), at least 1 so dim colours don't turn off
+const uint16_t	gamma_lut[256] PROGMEM = {
+	0, 1, 1, 1, 1, 1, 2, 3, 4, 5, 6, 8,
+	9, 11, 13, 16, 18, 20, 23, 26, 29, 33, 36, 40,
+	44, 48, 52, 57, 61, 66, 71, 77, 82, 88, 94, 100,
+	107, 113, 120, 127, 134, 142, 150, 157, 166, 174, 183, 191,
+	201, 210, 219, 229, 239, 249, 260, 271, 282, 293, 304, 316,
+	328, 340, 352, 365, 378, 391, 404, 418, 432, 446, 460, 475,
+	489, 504, 520, 535, 551, 567, 584, 600, 617, 634, 651, 669,
+	687, 705, 723, 742, 761, 780, 800, 819, 839, 859, 880, 901,
+	922, 943, 964, 986, 1008, 1030, 1053, 1076, 1099, 1122, 1146, 1170,
+	1194, 1219, 1243, 1268, 1294, 1319, 1345, 1371, 1397, 1424, 1451, 1478,
+	1506, 1533, 1561, 1590, 1618, 1647, 1676, 1706, 1735, 1765, 1796, 1826,
+	1857, 1888, 1919, 1951, 1983, 2015, 2048, 2080, 2113, 2147, 2180, 2214,
+	2249, 2283, 2318, 2353, 2388, 2424, 2460, 2496, 2533, 2569, 2607, 2644,
+	2682, 2720, 2758, 2796, 2835, 2874, 2914, 2953, 2993, 3034, 3074, 3115,
+	3156, 3198, 3240, 3282, 3324, 3367, 3410, 3453, 3497, 3540, 3585, 3629,
+	3674, 3719, 3764, 3810, 3856, 3902, 3949, 3995, 4043, 4090, 4138, 4186,
+	4234, 4283, 4332, 4381, 4431, 4481, 4531, 4581, 4632, 4683, 4735, 4786,
+	4838, 4891, 4943, 4996, 5050, 5103, 5157, 5211, 5266, 5320, 5376, 5431,
+	5487, 5543, 5599, 5656, 5713, 5770, 5828, 5886, 5944, 6002, 6061, 6120,
+	6180, 6240, 6300, 6360, 6421, 6482, 6543, 6605, 6667, 6729, 6792, 6855,
+	6918, 6982, 7045, 7110, 7174, 7239, 7304, 7370, 7435, 7502, 7568, 7635,
+	7702, 7769, 7837, 7905,
+};
+// 65536 / level, so v / level = (v * gamma_recip[level]) >> 16 (level 0 and 1 are never divided)
+const uint16_t	gamma_recip[32] PROGMEM = {
+	0, 0, 32768, 21845, 16384, 13107, 10923, 9362,
+	8192, 7282, 6554, 5958, 5461, 5041, 4681, 4369,
+	4096, 3855, 3641, 3449, 3277, 3121, 2979, 2849,
+	2731, 2621, 2521, 2427, 2341, 2260, 2185, 2114,
+};
+
+uint8_t	gamma_pwm(uint16_t v, uint8_t level, uint16_t recip)
+{
+	uint16_t	pwm;
+
+	if (level == 1)
+		return (v);
+	pwm = ((uint32_t)v * recip + 0x8000) >> 16;
+	if (pwm > 255)
+		pwm = 255;
+	return (pwm);
+}
+
+// frame = LED frame in wire order (global brightness, B, G, R)
+void	colour_to_frame(uint8_t r, uint8_t g, uint8_t b, uint8_t *frame)
+{
+	uint16_t	vr = pgm_read_word(&gamma_lut[r]);
+	uint16_t	vg = pgm_read_word(&gamma_lut[g]);
+	uint16_t	vb = pgm_read_word(&gamma_lut[b]);
+	uint16_t	max = vr;
+	uint16_t	recip;
+	uint8_t		level;
+
+	if (vg > max)
+		max = vg;
+	if (vb > max)
+		max = vb;
+	// level = ceil(max / 255), x / 255 = (x + 1 + (x >> 8)) >> 8 for 16-bit x
+	max += 254;
+	level = (max + 1 + (max >> 8)) >> 8;
+	recip = pgm_read_word(&gamma_recip[level]);
+	frame[0] = LED_OFF | level;
+	frame[1] = gamma_pwm(vb, level, recip);
+	frame[2] = gamma_pwm(vg, level, recip);
+	frame[3] = gamma_pwm(vr, level, recip);
+}
+
+void	leds_set_rgb(uint16_t led, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t	frame[LED_BYTES];
+
+	colour_to_frame(r, g, b, frame);
+	leds_set(led, frame[0], frame[3], frame[2], frame[1]);
+}
+
+// the colour goes through the pipeline once, not once per LED
+void	leds_fill_rgb(uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t	frame[LED_BYTES];
+
+	colour_to_frame(r, g, b, frame);
+	leds_fill(frame[0], frame[3], frame[2], frame[1]);
 }
 
 void	SPI_lights_off()
 {
-	start_frame();
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
-	set_one_led(0b11100000, 0x0, 0x0, 0x0);
-	end_frame();
+	leds_clear();
+	leds_show();
 }
 
 uint8_t	command[12]; // for rainbow, but 9 for rgb
 int	input_count = 0;
-uint8_t	led6_r = 0;
-uint8_t	led6_g = 0;
-uint8_t	led6_b = 0;
-
-uint8_t	led7_r = 0;
-uint8_t	led7_g = 0;
-uint8_t	led7_b = 0;
-
-uint8_t	led8_r = 0;
-uint8_t	led8_g = 0;
-uint8_t	led8_b = 0;
-int		rainbow = 0;
-int		counter = 0;
+volatile uint8_t	new_effect = 0; // EFFECT_*, 0 = nothing pending
+volatile uint8_t	new_stats = 0;
+// colour received by the UART ISR, applied by the main loop : the ISR can't wait
+// for the SPI ISR to finish sending the frame
+volatile uint8_t	new_led = 0; // '6' to '8', 0 = nothing pending
+volatile uint8_t	new_r = 0;
+volatile uint8_t	new_g = 0;
+volatile uint8_t	new_b = 0;
 
 bool	is_hexa(char c)
 {
@@ -212,75 +561,557 @@ uint8_t uint8_to_hex(char high, char low)
     return (result);
 }
 
-void	set_led(uint8_t led_num, uint8_t r, uint8_t g, uint8_t b)
+bool	rainbow_cmp(uint8_t *src, uint8_t *dst)
 {
-	if (led_num == '6')
+	int	i = 0;
+	while ((src[i] || dst[i]) && (i <= 11))
 	{
-		led6_r = r;
-		led6_g = g;
-		led6_b = b;
+		if (src[i] != dst[i])
+			return (false);
+		i++;
 	}
-	else if (led_num == '7')
+	return (true);
+}
+
+/*********************HSV TO RGB*************************/
+// hue 0 to HUE_MAX - 1 : 6 sectors of 256 steps (wheel() only had 85 steps of 3 per third)
+// in every sector one channel is at val, one at p (the floor), and the last one goes
+// up (t) or down (q) : the table picks which is which, so there's no branch per sector
+#define HUE_SECTOR 256
+#define HUE_MAX (6 * HUE_SECTOR)
+#define HSV_V 0
+#define HSV_P 1
+#define HSV_Q 2
+#define HSV_T 3
+
+const uint8_t	hsv_sectors[6][3] PROGMEM = {
+	{HSV_V, HSV_T, HSV_P}, // red -> yellow
+	{HSV_Q, HSV_V, HSV_P}, // yellow -> green
+	{HSV_P, HSV_V, HSV_T}, // green -> cyan
+	{HSV_P, HSV_Q, HSV_V}, // cyan -> blue
+	{HSV_T, HSV_P, HSV_V}, // blue -> magenta
+	{HSV_V, HSV_P, HSV_Q}, // magenta -> red
+};
+
+// a * b / 255 with a shift, exact at both ends (scale8(a, 0) = 0, scale8(a, 255) = a)
+uint8_t	scale8(uint8_t a, uint8_t b)
+{
+	return (((uint16_t)a * (b + 1)) >> 8);
+}
+
+void	hsv_to_rgb(uint16_t hue, uint8_t sat, uint8_t val, uint8_t *rgb)
+{
+	const uint8_t	*sector = hsv_sectors[hue >> 8];
+	uint8_t			frac = hue; // position inside the sector
+	uint8_t			levels[4];
+
+	levels[HSV_V] = val;
+	levels[HSV_P] = scale8(val, 255 - sat);
+	levels[HSV_Q] = scale8(val, 255 - scale8(sat, frac));
+	levels[HSV_T] = scale8(val, 255 - scale8(sat, 255 - frac));
+	rgb[0] = levels[pgm_read_byte(&sector[0])];
+	rgb[1] = levels[pgm_read_byte(&sector[1])];
+	rgb[2] = levels[pgm_read_byte(&sector[2])];
+}
+
+// LED i gets hue + i * step, in one pass over the framebuffer
+void	leds_fill_rainbow(uint16_t hue, uint16_t step)
+{
+	uint8_t		rgb[3];
+	uint16_t	i = 0;
+
+	hue %= HUE_MAX;
+	step %= HUE_MAX;
+	while (i < LED_COUNT)
+	{
+		hsv_to_rgb(hue, 255, 255, rgb);
+		leds_set_rgb(i, rgb[0], rgb[1], rgb[2]);
+		hue += step;
+		if (hue >= HUE_MAX)
+			hue -= HUE_MAX;
+		i++;
+	}
+}
+
+/*********************ANIMATION ENGINE*************************/
+// timer0 ticks every ms, each effect draws frame n into the framebuffer at its own rate
+// if the main loop was late the missed frames are skipped, so effects keep their speed
+#define EFFECT_NONE 0
+#define EFFECT_RAINBOW 1
+#define EFFECT_CHASE 2
+#define EFFECT_BREATHE 3
+#define EFFECT_FADE 4
+#define FADE_FRAMES 64
+
+typedef struct	s_effect
+{
+	void		(*render)(uint16_t frame);
+	uint16_t	period; // ms between frames
+	uint16_t	frames; // 0 = loops forever
+}				t_effect;
+
+volatile uint16_t	anim_ms = 0;
+uint8_t				anim_effect = EFFECT_NONE;
+uint16_t			anim_frame = 0;
+uint16_t			anim_next = 0; // anim_ms of the next frame
+uint16_t			anim_skipped = 0;
+// colour used by the effects (last one set) and the one before, for the fade
+uint8_t				anim_r = 0xFF;
+uint8_t				anim_g = 0xFF;
+uint8_t				anim_b = 0xFF;
+uint8_t				prev_r = 0;
+uint8_t				prev_g = 0;
+uint8_t				prev_b = 0;
+
+// doc 15.9.6 : compare match A interrupt, every OCR0A + 1 timer ticks
+ISR(TIMER0_COMPA_vect)
+{
+	anim_ms++;
+}
+
+void	anim_init()
+{
+	// doc 15.9.1 - Table 15-8 : CTC (010), TCNT0 goes back to 0 after OCR0A
+	TCCR0A = (1 << WGM01);
+	// doc 15.9.2 - Table 15-9 : prescaler 64 -> 250 kHz
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	OCR0A = (F_CPU / 64 / 1000) - 1; // 1 ms
+	TIMSK0 |= (1 << OCIE0A);
+}
+
+uint16_t	anim_now()
+{
+	uint16_t	ms;
+
+	cli();
+	ms = anim_ms;
+	sei();
+	return (ms);
+}
+
+// the whole wheel is spread over the strip and turns by 8 hue steps per frame.
+// frame * 8 wraps at 65536, which is not a multiple of HUE_MAX : wrap the frame first
+void	fx_rainbow(uint16_t frame)
+{
+	leds_fill_rainbow((frame % (HUE_MAX / 8)) * 8, HUE_MAX / LED_COUNT);
+}
+
+void	fx_chase(uint16_t frame)
+{
+	leds_clear();
+	leds_set_rgb(frame % LED_COUNT, anim_r, anim_g, anim_b);
+}
+
+void	fx_breathe(uint16_t frame)
+{
+	uint16_t	level = frame & 0x1FF;
+
+	if (level > 255)
+		level = 511 - level;
+	leds_fill_rgb(((uint16_t)anim_r * level) >> 8, ((uint16_t)anim_g * level) >> 8,
+		((uint16_t)anim_b * level) >> 8);
+}
+
+uint8_t	fade_step(uint8_t from, uint8_t to, uint16_t frame)
+{
+	return (from + ((int16_t)(to - from) * (int16_t)(frame + 1)) / FADE_FRAMES);
+}
+
+void	fx_fade(uint16_t frame)
+{
+	leds_fill_rgb(fade_step(prev_r, anim_r, frame), fade_step(prev_g, anim_g, frame),
+		fade_step(prev_b, anim_b, frame));
+}
+
+const t_effect	effects[] = {
+	[EFFECT_RAINBOW] = {fx_rainbow, 50, 0},
+	[EFFECT_CHASE] = {fx_chase, 150, 0},
+	[EFFECT_BREATHE] = {fx_breathe, 8, 0},
+	[EFFECT_FADE] = {fx_fade, 16, FADE_FRAMES},
+};
+
+void	anim_start(uint8_t effect)
+{
+	anim_effect = effect;
+	anim_frame = 0;
+	anim_next = anim_now();
+}
+
+void	anim_update()
+{
+	const t_effect	*fx;
+	uint16_t		now;
+	uint16_t		late;
+
+	if (anim_effect == EFFECT_NONE)
+		return ;
+	fx = &effects[anim_effect];
+	now = anim_now();
+	if ((int16_t)(now - anim_next) < 0) // not time yet (anim_ms wraps around)
+		return ;
+	late = (now - anim_next) / fx->period; // whole frames missed
+	anim_frame += late;
+	anim_skipped += late;
+	anim_next += (late + 1) * fx->period;
+	if (fx->frames && anim_frame >= fx->frames - 1)
 	{
-		led7_r = r;
-		led7_g = g;
-		led7_b = b;
+		anim_frame = fx->frames - 1; // last frame of a finite effect, then stop
+		anim_effect = EFFECT_NONE;
 	}
-	else if (led_num == '8')
+	fx->render(anim_frame);
+	leds_show();
+	anim_frame++;
+}
+
+/*********************PERSISTENCE*************************/
+// the LED state survives a reset : EEPROM = magic, layout version, LED count (low byte first),
+// effect, effect colour, previous colour, then the framebuffer as it is on the wire
+// the magic is cleared before the first byte that changes and written back last : a save
+// cut by a reset leaves no image, and a build with another layout or strip length ignores it
+// a write costs 3.4 ms and wears the cell, so the state is only saved once it has been
+// stable for PERSIST_DELAY_MS (a burst of commands = one save), one byte per main loop
+// pass without waiting on EEPE, and only the bytes that differ from the EEPROM
+#define PERSIST_MAGIC 0xD8
+#define PERSIST_INVALID 0x00
+#define PERSIST_VERSION 1 // to change with the header
+#define PERSIST_DELAY_MS 3000
+#define PERSIST_HEADER 11
+#define PERSIST_MAX_LEDS ((E2END + 1 - PERSIST_HEADER) / LED_BYTES)
+#define PERSIST_LEDS (LED_COUNT < PERSIST_MAX_LEDS ? LED_COUNT : PERSIST_MAX_LEDS)
+#define PERSIST_SIZE (PERSIST_HEADER + PERSIST_LEDS * LED_BYTES)
+
+uint8_t		persist_dirty = 0;
+uint16_t	persist_changed_ms = 0;
+uint16_t	persist_pos = 1; // next address to compare, the magic comes last
+
+void EEPROM_write(unsigned int uiAddress, unsigned char ucData)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address and Data Registers */
+	EEAR = uiAddress;
+	EEDR = ucData;
+	// doc 8.6.3 : EEPE has to be set within 4 cycles after EEMPE, no interrupt in between
+	cli();
+	/* Write logical one to EEMPE */
+	EECR |= (1<<EEMPE);
+	/* Start eeprom write by setting EEPE */
+	EECR |= (1<<EEPE);
+	sei();
+}
+
+unsigned char EEPROM_read(unsigned int uiAddress)
+{
+	/* Wait for completion of previous write */
+	while(EECR & (1<<EEPE));
+	/* Set up address register */
+	EEAR = uiAddress;
+	/* Start eeprom read by writing EERE */
+	EECR |= (1<<EERE);
+	/* Return data from Data Register */
+	return EEDR;
+}
+
+// what the EEPROM should hold at addr
+uint8_t	persist_byte(uint16_t addr)
+{
+	const uint8_t	header[PERSIST_HEADER] = {PERSIST_MAGIC, PERSIST_VERSION,
+		PERSIST_LEDS & 0xFF, PERSIST_LEDS >> 8, anim_effect,
+		anim_r, anim_g, anim_b, prev_r, prev_g, prev_b};
+
+	if (addr < PERSIST_HEADER)
+		return (header[addr]);
+	return (leds[addr - PERSIST_HEADER]);
+}
+
+// every change pushes the save back, so repeated commands are coalesced
+void	persist_touch()
+{
+	persist_dirty = 1;
+	persist_changed_ms = anim_now();
+	persist_pos = 1;
+}
+
+// while an effect runs leds[] holds one of its frames : only the header is saved,
+// persist_load() restarts the effect and it redraws the strip
+// addresses 1 to size - 1, then persist_pos == size stands for the magic at 0
+void	persist_update()
+{
+	uint8_t		value;
+	uint16_t	addr;
+	uint16_t	size = PERSIST_SIZE;
+
+	if (!persist_dirty || (uint16_t)(anim_now() - persist_changed_ms) < PERSIST_DELAY_MS)
+		return ;
+	if (EECR & (1 << EEPE)) // last byte still being written, come back later
+		return ;
+	if (anim_effect != EFFECT_NONE)
+		size = PERSIST_HEADER;
+	while (persist_pos <= size)
 	{
-		led8_r = r;
-		led8_g = g;
-		led8_b = b;
+		addr = persist_pos < size ? persist_pos : 0;
+		value = persist_byte(addr);
+		if (EEPROM_read(addr) != value)
+		{
+			if (addr && EEPROM_read(0) == PERSIST_MAGIC)
+			{
+				EEPROM_write(0, PERSIST_INVALID); // same byte again on the next pass
+				return ;
+			}
+			EEPROM_write(addr, value); // doesn't wait, EEPE was clear
+			persist_pos++;
+			return ;
+		}
+		persist_pos++;
 	}
-	start_frame();
-	set_one_led(0b11100001, led6_r, led6_g, led6_b);
-	set_one_led(0b11100001, led7_r, led7_g, led7_b);
-	set_one_led(0b11100001, led8_r, led8_g, led8_b);
-	end_frame();
-	rainbow = 0;
+	persist_dirty = 0;
 }
 
-bool	rainbow_cmp(uint8_t *src, uint8_t *dst)
+// boot : reads back about PERSIST_SIZE bytes, well under a ms even for a long strip
+bool	persist_load()
 {
-	int	i = 0;
-	while ((src[i] || dst[i]) && (i <= 11))
+	uint16_t	i = 0;
+	uint8_t		effect;
+
+	if (EEPROM_read(0) != PERSIST_MAGIC || EEPROM_read(1) != PERSIST_VERSION
+		|| EEPROM_read(2) != (PERSIST_LEDS & 0xFF) || EEPROM_read(3) != PERSIST_LEDS >> 8)
+		return (false);
+	anim_r = EEPROM_read(5);
+	anim_g = EEPROM_read(6);
+	anim_b = EEPROM_read(7);
+	prev_r = EEPROM_read(8);
+	prev_g = EEPROM_read(9);
+	prev_b = EEPROM_read(10);
+	leds_clear();
+	while (i < PERSIST_LEDS * LED_BYTES)
 	{
-		if (src[i] != dst[i])
-			return (false);
+		leds[i] = EEPROM_read(PERSIST_HEADER + i);
 		i++;
 	}
+	leds_gen++;
+	leds_show();
+	effect = EEPROM_read(4);
+	if (effect != EFFECT_NONE && effect <= EFFECT_FADE)
+		anim_start(effect);
 	return (true);
 }
 
-void wheel(uint8_t pos)
+void	set_led(uint8_t led_num, uint8_t r, uint8_t g, uint8_t b)
+{
+	anim_effect = EFFECT_NONE;
+	prev_r = anim_r;
+	prev_g = anim_g;
+	prev_b = anim_b;
+	anim_r = r;
+	anim_g = g;
+	anim_b = b;
+	leds_set_rgb(led_num - '6', r, g, b); // D6 is the first LED of the chain
+	leds_show();
+	persist_touch();
+}
+
+#ifdef HSV_BENCH
+/*********************HSV BENCHMARK*************************/
+// make DEFS=-DHSV_BENCH : cycles per colour for the old 3 branch wheel() and for
+// hsv_to_rgb(), counted with timer1 without prescaler (1 tick = 1 cycle)
+// a fill of a long strip is several times 65536 cycles : the overflows are counted by
+// TIMER1_OVF_vect, TOV1 alone would only tell about one of them
+volatile uint8_t	bench_sink;
+volatile uint16_t	bench_overflows = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+	bench_overflows++;
+}
+
+void	bench_start()
+{
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCNT1 = 0;
+	TIFR1 = (1 << TOV1);
+	bench_overflows = 0;
+	TIMSK1 |= (1 << TOIE1);
+	TCCR1B = (1 << CS10);
+}
+
+uint32_t	bench_stop()
+{
+	uint32_t	cycles;
+
+	TCCR1B = 0;
+	TIMSK1 &= ~(1 << TOIE1);
+	cycles = TCNT1;
+	if (TIFR1 & (1 << TOV1)) // overflow right before the stop, its ISR didn't run
+	{
+		TIFR1 = (1 << TOV1);
+		bench_overflows++;
+	}
+	return (cycles + ((uint32_t)bench_overflows << 16));
+}
+
+// colour part of the wheel() every exercise had
+void	wheel_rgb(uint8_t pos, uint8_t *rgb)
 {
 	pos = 255 - pos;
 	if (pos < 85)
 	{
-		start_frame();
-		set_one_led(0b11100001, 255 - pos * 3, 0, pos * 3);
-		set_one_led(0b11100001, 255 - pos * 3, 0, pos * 3);
-		set_one_led(0b11100001, 255 - pos * 3, 0, pos * 3);
-		end_frame();
+		rgb[0] = 255 - pos * 3;
+		rgb[1] = 0;
+		rgb[2] = pos * 3;
 	}
 	else if (pos < 170)
 	{
 		pos = pos - 85;
-		start_frame();
-		set_one_led(0b11100001, 0, pos * 3, 255 - pos * 3);
-		set_one_led(0b11100001, 0, pos * 3, 255 - pos * 3);
-		set_one_led(0b11100001, 0, pos * 3, 255 - pos * 3);
-		end_frame();
+		rgb[0] = 0;
+		rgb[1] = pos * 3;
+		rgb[2] = 255 - pos * 3;
 	}
 	else
 	{
 		pos = pos - 170;
-		start_frame();
-		set_one_led(0b11100001, pos * 3, 255 - pos * 3, 0);
-		set_one_led(0b11100001, pos * 3, 255 - pos * 3, 0);
-		set_one_led(0b11100001, pos * 3, 255 - pos * 3, 0);
-		end_frame();
+		rgb[0] = pos * 3;
+		rgb[1] = 255 - pos * 3;
+		rgb[2] = 0;
+	}
+}
+
+void	hsv_bench()
+{
+	uint8_t		rgb[3];
+	uint16_t	i;
+	uint32_t	cycles;
+
+	i = 0;
+	bench_start();
+	while (i < 256)
+	{
+		wheel_rgb(i, rgb);
+		bench_sink = rgb[0] ^ rgb[1] ^ rgb[2];
+		i++;
+	}
+	cycles = bench_stop();
+	uart_printstr("wheel() : ");
+	uart_printnumber(cycles / 256);
+	uart_printstr(" cycles per colour (256 hues)\r\n");
+
+	i = 0;
+	bench_start();
+	while (i < 256)
+	{
+		hsv_to_rgb(i * 6, 255, 255, rgb);
+		bench_sink = rgb[0] ^ rgb[1] ^ rgb[2];
+		i++;
 	}
+	cycles = bench_stop();
+	uart_printstr("hsv_to_rgb() : ");
+	uart_printnumber(cycles / 256);
+	uart_printstr(" cycles per colour (1536 hues)\r\n");
+
+	bench_start();
+	leds_fill_rainbow(0, HUE_MAX / LED_COUNT);
+	cycles = bench_stop();
+	uart_printstr("leds_fill_rainbow() : ");
+	uart_printnumber(cycles / LED_COUNT);
+	uart_printstr(" cycles per LED, gamma included\r\n");
+}
+#endif
+
+#ifdef SPI_BENCH
+/*********************BENCHMARK*************************/
+// make DEFS=-DSPI_BENCH LED_COUNT=144 : frames/s for 3 LEDs and for the whole strip
+// at every SPI clock, measured with timer1 (fck/64 = 4us per tick). 32 frames of 144 LEDs
+// are more than 65536 ticks : the overflows (TOV1, every 262 ms) are counted between
+// frames, a frame is 38 ms at most (fck/128)
+// frames up to LED_POLL_BYTES are polled, the longer ones go through the ISR : the passes
+// of the wait loop per ms of transfer tell how much of the CPU the ISR leaves
+#define BENCH_FRAMES 32
+
+uint32_t	bench_spins = 0; // wait loop passes during the last bench_fps()
+
+uint32_t	bench_fps(uint16_t count)
+{
+	uint16_t	i = 0;
+	uint32_t	ticks = 0;
+
+	bench_spins = 0;
+	TCCR1A = 0;
+	TCNT1 = 0;
+	TIFR1 = (1 << TOV1);
+	TCCR1B = (1 << CS11) | (1 << CS10);
+	while (i < BENCH_FRAMES)
+	{
+		leds_send(leds, count);
+		while (!leds_done)
+			bench_spins++;
+		if (TIFR1 & (1 << TOV1))
+		{
+			TIFR1 = (1 << TOV1);
+			ticks += 0x10000;
+		}
+		i++;
+	}
+	TCCR1B = 0;
+	if (TIFR1 & (1 << TOV1))
+		ticks += 0x10000;
+	ticks += TCNT1;
+	bench_spins = bench_spins * 250 / ticks; // per ms, 250 ticks
+	return (((uint32_t)BENCH_FRAMES * (F_CPU / 64)) / ticks);
+}
+
+void	spi_bench()
+{
+	const uint8_t	divs[] = {2, 4, 8, 16, 32, 64, 128};
+	uint16_t		counts[] = {LED_COUNT < 3 ? LED_COUNT : 3, LED_COUNT};
+	uint8_t			c = 0;
+	uint8_t			d;
+	uint8_t			dev;
+
+	leds_clear();
+	while (c < (LED_COUNT > 3 ? 2 : 1))
+	{
+		dev = FRAME_BYTES(counts[c]) <= LED_POLL_BYTES ? SPI_DEV_LEDS : SPI_DEV_LEDS_ISR;
+		d = 0;
+		while (d < sizeof(divs))
+		{
+			spi_profiles[dev][0] = SPI_SPR(divs[d]);
+			spi_profiles[dev][1] = SPI_2X(divs[d]);
+			spi_device = SPI_DEV_DEFAULT; // force SPI_select to reload the profile
+			uart_printstr("LEDs ");
+			uart_printnumber(counts[c]);
+			uart_printstr(dev == SPI_DEV_LEDS ? " polled" : " ISR");
+			uart_printstr(" fck/");
+			uart_printnumber(divs[d]);
+			uart_printstr(" : ");
+			uart_printnumber(bench_fps(counts[c]));
+			uart_printstr(" frames/s, wait loop passes per ms : ");
+			uart_printnumber(bench_spins);
+			uart_printstr("\r\n");
+			d++;
+		}
+		c++;
+	}
+	spi_profiles[SPI_DEV_LEDS][0] = SPI_SPR(SPI_LEDS_DIV);
+	spi_profiles[SPI_DEV_LEDS][1] = SPI_2X(SPI_LEDS_DIV);
+	spi_profiles[SPI_DEV_LEDS_ISR][0] = SPI_SPR(SPI_LEDS_ISR_DIV);
+	spi_profiles[SPI_DEV_LEDS_ISR][1] = SPI_2X(SPI_LEDS_ISR_DIV);
+	spi_device = SPI_DEV_DEFAULT;
+}
+#endif
+
+#ifndef LED_USART_SPI
+#define WRONG_INPUT "\r\nWrong input, try this format : #RRGGBBDX, #FXn (1 to 4), #STATS or type #FULLRAINBOW\r\n"
+
+// printed from the main loop, the counters are only written there
+void	print_stats()
+{
+	uart_printstr("\nframes pushed : ");
+	uart_printnumber(leds_pushed);
+	uart_printstr("\r\nframes skipped (unchanged) : ");
+	uart_printnumber(leds_skipped);
+	uart_printstr("\r\nanimation frames dropped (late) : ");
+	uart_printnumber(anim_skipped);
+	uart_printstr("\r\n");
 }
 
 // libC AVR function for interrupts
@@ -298,11 +1129,32 @@ ISR(USART_RX_vect)
 			uint8_t	rainbow_tab[] = "#FULLRAINBOW\r";
 			if (rainbow_cmp(rainbow_tab, command) == true)
 			{
-				rainbow = 1;
+				new_effect = EFFECT_RAINBOW;
 				uart_printstr("\nSuccessfully set FULL RAINBOWWWWWWWWW\r\n");
 			}
 			else
-				uart_printstr("\r\nWrong input, try this format : #RRGGBBDX or type #FULLRAINBOW\r\n");
+				uart_printstr(WRONG_INPUT);
+		}
+		/***************************CHECK EFFECT*******************************/
+		else if (input_count == 5) // POTENTIAL #FXn : 1 rainbow, 2 chase, 3 breathe, 4 fade
+		{
+			if ((command[0] == '#') && (command[1] == 'F') && (command[2] == 'X')
+				&& (command[3] >= '1') && (command[3] <= '4'))
+			{
+				new_effect = command[3] - '0';
+				uart_printstr("\nSuccessfully set effect\r\n");
+			}
+			else
+				uart_printstr(WRONG_INPUT);
+		}
+		/***************************CHECK STATS*******************************/
+		else if (input_count == 7) // POTENTIAL #STATS
+		{
+			uint8_t	stats_tab[] = "#STATS\r";
+			if (rainbow_cmp(stats_tab, command) == true)
+				new_stats = 1;
+			else
+				uart_printstr(WRONG_INPUT);
 		}
 		/***************************CHECK RGB*******************************/
 		else if (input_count == 10) // POTENTIAL RGB SET
@@ -313,15 +1165,18 @@ ISR(USART_RX_vect)
 				uint8_t	R = uint8_to_hex(command[1], command[2]);
 				uint8_t	G = uint8_to_hex(command[3], command[4]);
 				uint8_t	B = uint8_to_hex(command[5], command[6]);
-				uint8_t		LED = command[8];
-				set_led(LED, R, G, B);
+				new_r = R;
+				new_g = G;
+				new_b = B;
+				new_led = command[8];
+				new_effect = 0;
 				uart_printstr("\nSuccessfully set new colour\r\n");
 			}
 			else
-				uart_printstr("\r\nWrong input, try this format : #RRGGBBDX or type #FULLRAINBOW\r\n");
+				uart_printstr(WRONG_INPUT);
 		}
 		else
-			uart_printstr("\r\nWrong input, try this format : #RRGGBBDX or type #FULLRAINBOW\r\n");
+			uart_printstr(WRONG_INPUT);
 		/***************RESET BUFFER**************/
 		int	i = 0;
 		while (i < 12)
@@ -332,25 +1187,62 @@ ISR(USART_RX_vect)
 		input_count = 0;
 	}
 }
+#endif
 
 int	main()
 {
 	SPI_MasterInit();
 	adc_init();
+#ifdef LED_USART_SPI
+	leds_usart_init();
+	new_effect = EFFECT_RAINBOW; // USART0 is the LED bus, no serial console to ask for it
+	sei();
+#else
 	uart_init();
 	sei();
 	// doc 20.11.3 : RX complete interrupt enable
 	UCSR0B |= (1 << RXCIE0);
-	SPI_lights_off();
+#endif
+	anim_init();
+	if (!persist_load())
+		SPI_lights_off();
+#ifdef SPI_BENCH
+	spi_bench();
+#endif
+#ifdef HSV_BENCH
+	hsv_bench();
+#endif
 
 	while (1)
 	{
-		counter++;
-		if (counter == 255)
-			counter = 0;
-		
-		if (rainbow)
-			wheel(counter);
-		_delay_ms(50);
+		if (new_led)
+		{
+			cli();
+			uint8_t	led = new_led;
+			uint8_t	r = new_r;
+			uint8_t	g = new_g;
+			uint8_t	b = new_b;
+			new_led = 0;
+			sei();
+			set_led(led, r, g, b);
+		}
+		if (new_effect)
+		{
+			cli();
+			uint8_t	effect = new_effect;
+			new_effect = 0;
+			sei();
+			anim_start(effect);
+			persist_touch();
+		}
+		anim_update();
+		persist_update();
+#ifndef LED_USART_SPI
+		if (new_stats)
+		{
+			new_stats = 0;
+			print_stats();
+		}
+#endif
 	}
 }
@@ -80,6 +80,48 @@ void	end_frame()
 	}
 }
 
+/*********************BAND QUANTIZER*************************/
+// maps the potentiometer to a band with hysteresis : the value has to go hyst
+// past an edge to change band, so a reading sitting on a boundary doesn't make
+// the output flicker. band_update() only returns 1 on a real transition.
+#define BAND_NONE	0xFF
+#define BAND_HYST	8	// ADC LSB, a bit more than the potentiometer noise
+// lower edge of the band above "percent" of the ADC range, same rounding as adc > 1023 * 0.xx
+#define BAND_EDGE(percent)	((uint16_t)(1023UL * (percent) / 100 + 1))
+
+typedef struct	s_bands
+{
+	const uint16_t	*edges;	// lower edge of bands 1 to count - 1, increasing
+	uint8_t			count;
+	uint8_t			hyst;
+	uint8_t			band;	// current band, BAND_NONE before the first value
+}	t_bands;
+
+uint8_t	band_update(t_bands *q, uint16_t value)
+{
+	uint8_t	band = q->band;
+
+	if (band == BAND_NONE) // first value, no previous band to stick to
+	{
+		band = 0;
+		while (band + 1 < q->count && value >= q->edges[band])
+			band++;
+	}
+	else
+	{
+		while (band + 1 < q->count && value >= q->edges[band] + q->hyst)
+			band++;
+		while (band > 0 && value + q->hyst < q->edges[band - 1])
+			band--;
+	}
+	if (band == q->band)
+		return (0);
+	q->band = band;
+	return (1);
+}
+
+const uint16_t	pot_edges[] = {BAND_EDGE(1), BAND_EDGE(33), BAND_EDGE(66)};
+t_bands			pot_bands = {pot_edges, 4, BAND_HYST, BAND_NONE};
 uint16_t	adc = 0;
 int			rgb = 0;
 int			LED = 0;
@@ -160,14 +202,8 @@ int	main()
 		{}
 		adc = (ADC);
 
-		if ((adc < (1023 * 0.01)))
-			rgb = 0;
-		else if ((adc > (1023 * 0.01)) && (adc <= (1023 * 0.33)))
-			rgb = 1;
-		else if ((adc > (1023 * 0.33)) && (adc <= (1023 * 0.66)))
-			rgb = 2;
-		else
-			rgb = 3;
+		if (band_update(&pot_bands, adc))
+			rgb = pot_bands.band; // 0 off, 1 red, 2 green, 3 blue
 		
 		if (!(PIND & (1 << PIND4))) // button SW2 : switch LED
 		{
@@ -0,0 +1,565 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <stdbool.h>
+/*********************INTRODUCTION*************************/
+// doc 19.2
+// board to board link over SPI, way faster than the 100 kHz I2C of the rush :
+// the master pushes frames in bulk, the slave receives them from SPI_STC_vect into a ring
+// buffer and the main loop checks them
+// frame = SYNC, LEN, LEN bytes of payload, CRC16 (xmodem) of LEN + payload, high byte first
+// both boards print the payload bytes per second on the UART every second
+// wiring : MOSI-MOSI (PB3), MISO-MISO (PB4), SCK-SCK (PB5), SS-SS (PB2), GND-GND
+// make DEFS=-DLINK_MASTER for the master, nothing for the slave
+// make DEFS="-DLINK_MASTER -DLINK_LOOPBACK" with MOSI wired to MISO checks the link on one board
+// make DEFS=-DLINK_SELFTEST runs the frame parser tests on one board, no wiring
+
+#define LINK_SYNC 0xA5
+#define LINK_MAX_PAYLOAD 64
+#define LINK_FRAME_MAX (LINK_MAX_PAYLOAD + 4)
+#define LINK_RING_SIZE 256 // uint8_t indexes wrap on their own
+#ifndef LINK_SPI_DIV
+# define LINK_SPI_DIV 16 // 1 MHz : the slave ISR needs a few dozen cycles per byte
+#endif
+
+void	 uart_tx(char c)
+{
+	// doc 20.6.2 example of code
+	// doc 20.6.3 : checks when transmit buffer is empty
+	while (!(UCSR0A & (1<<UDRE0)))
+	{}
+	// doc 20.6.1 : sending frames (5 to 8 bits)
+	UDR0 = c;
+}
+
+void	uart_printstr(char *str)
+{
+	int	i = 0;
+	while (str[i])
+	{
+		uart_tx(str[i]);
+		i++;
+	}
+}
+
+/*********************UART OUTPUT QUEUE*************************/
+// a blocking print takes ms at 115200 bauds while the slave gets a byte every 8 us,
+// so the stats are queued and the main loop sends one char whenever UDR0 is free
+#define OUT_SIZE 128
+char	out[OUT_SIZE];
+uint8_t	out_len = 0;
+uint8_t	out_pos = 0;
+
+void	out_str(char *str)
+{
+	int	i = 0;
+	while (str[i] && out_len < OUT_SIZE)
+	{
+		out[out_len] = str[i];
+		out_len++;
+		i++;
+	}
+}
+
+void	out_number(uint32_t n)
+{
+	if (n >= 10)
+		out_number(n / 10);
+	if (out_len < OUT_SIZE)
+	{
+		out[out_len] = n % 10 + '0';
+		out_len++;
+	}
+}
+
+void	out_poll()
+{
+	if (out_pos == out_len || !(UCSR0A & (1 << UDRE0)))
+		return ;
+	UDR0 = out[out_pos];
+	out_pos++;
+	if (out_pos == out_len)
+	{
+		out_pos = 0;
+		out_len = 0;
+	}
+}
+
+void	uart_init()
+{
+	// UART config to 8N1 (8-bit, no parity, stop-bit = 1)
+	// doc 20.6 : enable transmitter 0
+	// doc 20.7 : enable receiver 0
+	UCSR0B |= (1 << TXEN0);
+	UCSR0B |= (1 << RXEN0);
+
+	// doc 20.11.4 - Table 20-8 : async mode chosen caue asked for "UART" with no S 00
+	UCSR0C &= ~(1 << UMSEL01);
+	UCSR0C &= ~(1 << UMSEL00);
+
+	// doc 20.11.4 - Table 20-9 : parity mode (checks of parity) = none 00
+	UCSR0C &= ~(1 << UPM01);
+	UCSR0C &= ~(1 << UPM00);
+
+	// doc 20.11.4 - Table 20-10 : stop bit select = one (bit set to 0)
+	UCSR0C &= ~(1 << USBS0);
+
+	// doc 20.11.4 - Table 20-11 : character size = 8-bit (011)
+	UCSR0C &= ~(1 << UCSZ02);
+	UCSR0C |= (1 << UCSZ01);
+	UCSR0C |= (1 << UCSZ00);
+
+	// doc 20.11.4 - Table 20-12 : clock plarity for sync mode only, set to 0 for async
+	UCSR0C &= ~(1 << UCPOL0);
+
+	// doc 20.3.1 - Table 20-1 : baudrate or UBRRn calculation
+	// doc 20.11.5 : USART baud rate set with UBRRnH-L
+	// UBRRn = (F_CPU / 8 * BAUD) - 1
+	UBRR0L = (float)((F_CPU / (16.0 * UART_BAUDRATE) + 0.5)) - 1;
+	UBRR0H = 0;
+}
+
+/*********************SECOND TIMER*************************/
+volatile uint8_t	second = 0;
+
+// doc 16.11.1 - Table 16-4 : CTC on OCR1A (0100), prescaler 1024 -> 15625 Hz
+void	timer1_init()
+{
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12) | (1 << CS12) | (1 << CS10);
+	OCR1A = (F_CPU / 1024) - 1; // 1 s
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	second = 1;
+}
+
+/*********************FRAME PARSER*************************/
+#define WAIT_SYNC 0
+#define WAIT_LEN 1
+#define WAIT_PAYLOAD 2
+#define WAIT_CRC_HI 3
+#define WAIT_CRC_LO 4
+
+uint8_t		parse_state = WAIT_SYNC;
+uint8_t		parse_len = 0;
+uint8_t		parse_pos = 0;
+uint16_t	parse_crc = 0;
+uint16_t	parse_rx_crc = 0;
+uint8_t		payload[LINK_MAX_PAYLOAD];
+
+uint32_t	frames_ok = 0;
+uint32_t	frames_bad = 0;
+uint32_t	bytes_ok = 0; // payload bytes of the good frames, since the last print
+
+// fed one byte at a time, true when a good frame is in payload[]
+bool	link_parse(uint8_t c)
+{
+	if (parse_state == WAIT_SYNC)
+	{
+		if (c == LINK_SYNC)
+			parse_state = WAIT_LEN;
+	}
+	else if (parse_state == WAIT_LEN)
+	{
+		if (c == 0 || c > LINK_MAX_PAYLOAD)
+		{
+			frames_bad++;
+			parse_state = WAIT_SYNC;
+			return (false);
+		}
+		parse_len = c;
+		parse_pos = 0;
+		parse_crc = _crc_xmodem_update(0, c);
+		parse_state = WAIT_PAYLOAD;
+	}
+	else if (parse_state == WAIT_PAYLOAD)
+	{
+		payload[parse_pos] = c;
+		parse_crc = _crc_xmodem_update(parse_crc, c);
+		parse_pos++;
+		if (parse_pos == parse_len)
+			parse_state = WAIT_CRC_HI;
+	}
+	else if (parse_state == WAIT_CRC_HI)
+	{
+		parse_rx_crc = (uint16_t)c << 8;
+		parse_state = WAIT_CRC_LO;
+	}
+	else
+	{
+		parse_state = WAIT_SYNC;
+		if ((parse_rx_crc | c) != parse_crc)
+		{
+			frames_bad++;
+			return (false);
+		}
+		frames_ok++;
+		bytes_ok += parse_len;
+		return (true);
+	}
+	return (false);
+}
+
+// SS edge, the frame on the wire is over : one that is still being parsed lost bytes,
+// without this its missing bytes would be taken from the next frame
+void	link_reset()
+{
+	if (parse_state != WAIT_SYNC)
+	{
+		frames_bad++;
+		parse_state = WAIT_SYNC;
+	}
+}
+
+// frame = SYNC, LEN, payload, CRC into frame[], returns its length
+uint8_t	link_encode(uint8_t *frame, uint8_t *data, uint8_t len)
+{
+	uint16_t	crc = _crc_xmodem_update(0, len);
+	uint8_t		i = 0;
+
+	frame[0] = LINK_SYNC;
+	frame[1] = len;
+	while (i < len)
+	{
+		crc = _crc_xmodem_update(crc, data[i]);
+		frame[2 + i] = data[i];
+		i++;
+	}
+	frame[2 + len] = crc >> 8;
+	frame[3 + len] = crc;
+	return (len + 4);
+}
+
+void	print_stats()
+{
+	out_str("payload : ");
+	out_number(bytes_ok);
+	out_str(" bytes/s, frames ok : ");
+	out_number(frames_ok);
+	out_str(", bad : ");
+	out_number(frames_bad);
+	out_str("\r\n");
+	bytes_ok = 0;
+}
+
+#if defined(LINK_SELFTEST)
+/*********************SELF TEST*************************/
+// every payload length, each frame fed whole, with its last byte lost, with a byte flipped
+// and after garbage, link_reset() standing for the SS edge after each of them
+uint8_t	test_frame[LINK_FRAME_MAX];
+uint8_t	test_data[LINK_MAX_PAYLOAD];
+
+// frame bytes except skip, flip gets a bit flipped (LINK_FRAME_MAX for none), then SS high
+void	test_feed(uint8_t size, uint8_t skip, uint8_t flip)
+{
+	uint8_t	i = 0;
+
+	while (i < size)
+	{
+		if (i != skip)
+			link_parse(i == flip ? test_frame[i] ^ 0x10 : test_frame[i]);
+		i++;
+	}
+	link_reset();
+}
+
+// frames_ok and frames_bad against what the cases so far should give
+bool	test_check(uint32_t ok, uint32_t bad, uint8_t len)
+{
+	uint8_t	i = 0;
+
+	if (frames_ok != ok || frames_bad != bad)
+		return (false);
+	while (i < len)
+	{
+		if (payload[i] != test_data[i])
+			return (false);
+		i++;
+	}
+	return (true);
+}
+
+int	main()
+{
+	uint8_t		len = 1;
+	uint8_t		size;
+	uint8_t		i;
+	uint32_t	ok = 0;
+	uint32_t	bad = 0;
+
+	uart_init();
+	while (len <= LINK_MAX_PAYLOAD)
+	{
+		i = 0;
+		while (i < len)
+		{
+			test_data[i] = len * 7 + i;
+			i++;
+		}
+		size = link_encode(test_frame, test_data, len);
+		test_feed(size, LINK_FRAME_MAX, LINK_FRAME_MAX);
+		if (!test_check(++ok, bad, len))
+			break ;
+		test_feed(size, size - 1, LINK_FRAME_MAX);
+		test_feed(size, LINK_FRAME_MAX, LINK_FRAME_MAX);
+		if (!test_check(++ok, ++bad, len))
+			break ;
+		test_feed(size, LINK_FRAME_MAX, 2 + len / 2);
+		if (!test_check(ok, ++bad, 0))
+			break ;
+		link_parse(0x00);
+		link_parse(LINK_SYNC - 1);
+		test_feed(size, LINK_FRAME_MAX, LINK_FRAME_MAX);
+		if (!test_check(++ok, bad, len))
+			break ;
+		len++;
+	}
+	if (len <= LINK_MAX_PAYLOAD)
+	{
+		out_str("self test : FAIL, payload length ");
+		out_number(len);
+	}
+	else
+	{
+		out_str("self test : OK, frames ok ");
+		out_number(frames_ok);
+		out_str(", bad ");
+		out_number(frames_bad);
+	}
+	out_str("\r\n");
+	while (out_len)
+		out_poll();
+	while (1)
+	{}
+}
+
+#elif defined(LINK_MASTER)
+/*********************MASTER*************************/
+// doc 19.5.2 - Table 19-5 : SPI2X, SPR1, SPR0 for each divider
+#if LINK_SPI_DIV == 2
+# define LINK_SPR 0
+# define LINK_2X (1 << SPI2X)
+#elif LINK_SPI_DIV == 4
+# define LINK_SPR 0
+# define LINK_2X 0
+#elif LINK_SPI_DIV == 8
+# define LINK_SPR (1 << SPR0)
+# define LINK_2X (1 << SPI2X)
+#elif LINK_SPI_DIV == 16
+# define LINK_SPR (1 << SPR0)
+# define LINK_2X 0
+#elif LINK_SPI_DIV == 32
+# define LINK_SPR (1 << SPR1)
+# define LINK_2X (1 << SPI2X)
+#elif LINK_SPI_DIV == 64
+# define LINK_SPR (1 << SPR1)
+# define LINK_2X 0
+#elif LINK_SPI_DIV == 128
+# define LINK_SPR ((1 << SPR1) | (1 << SPR0))
+# define LINK_2X 0
+#else
+# error "LINK_SPI_DIV must be 2, 4, 8, 16, 32, 64 or 128"
+#endif
+
+void SPI_MasterInit(void)
+{
+/* Set MOSI and SCK output, all others input */
+	// doc 14.3.1 (Alternate Functions of Port B)
+	// DDB3 instead of PB3 which controls the pull-up for MOSI
+	// DDB2 = SS pin, drives the SS of the slave
+	DDRB = (1 << DDB3) | (1 << DDB2) |(1 << DDB5);
+	PORTB |= (1 << PORTB2); // slave not selected
+	// SPE = enable SPI
+	// MSTR = set as master
+	SPCR = (1<<SPE) | (1<<MSTR) | LINK_SPR;
+	SPSR = LINK_2X;
+}
+
+// returns the byte clocked in on MISO at the same time
+uint8_t SPI_MasterTransmit(char cData)
+{
+	/* Start transmission */
+	SPDR = cData;
+	/* Wait for transmission complete */
+	while(!(SPSR & (1<<SPIF)))
+	;
+	return (SPDR);
+}
+
+// sends one byte and, in loopback, checks it like the slave would
+void	link_tx(uint8_t c)
+{
+	uint8_t	rx = SPI_MasterTransmit(c);
+#ifdef LINK_LOOPBACK
+	link_parse(rx);
+#else
+	(void)rx;
+#endif
+}
+
+// one whole frame between SS low and SS high, encoded first so no wait between bytes
+void	link_send(uint8_t *data, uint8_t len)
+{
+	uint8_t	frame[LINK_FRAME_MAX];
+	uint8_t	size = link_encode(frame, data, len);
+	uint8_t	i = 0;
+
+	PORTB &= ~(1 << PORTB2);
+	while (i < size)
+	{
+		link_tx(frame[i]);
+		i++;
+	}
+	PORTB |= (1 << PORTB2);
+#ifdef LINK_LOOPBACK
+	link_reset();
+#endif
+}
+
+int	main()
+{
+	uint8_t		data[LINK_MAX_PAYLOAD];
+	uint8_t		seq = 0;
+	uint8_t		i;
+	uint32_t	sent = 0;
+
+	uart_init();
+	timer1_init();
+	SPI_MasterInit();
+	sei();
+	uart_printstr("SPI link master\r\n");
+	while (1)
+	{
+		i = 0;
+		while (i < LINK_MAX_PAYLOAD)
+		{
+			data[i] = seq + i;
+			i++;
+		}
+		link_send(data, LINK_MAX_PAYLOAD);
+		sent += LINK_MAX_PAYLOAD;
+		seq++;
+		out_poll();
+		if (second)
+		{
+			second = 0;
+			out_str("sent : ");
+			out_number(sent);
+			out_str(" bytes/s\r\n");
+			sent = 0;
+#ifdef LINK_LOOPBACK
+			print_stats();
+#endif
+		}
+	}
+}
+
+#else
+/*********************SLAVE*************************/
+uint8_t				ring[LINK_RING_SIZE];
+volatile uint8_t	ring_head = 0; // written by the ISR
+volatile uint8_t	ring_tail = 0; // written by the main loop
+volatile uint16_t	ring_overflows = 0;
+#define LINK_MARKS_SIZE 8 // power of 2
+uint8_t				link_marks[LINK_MARKS_SIZE]; // ring_head at each SS edge
+volatile uint8_t	marks_head = 0;
+volatile uint8_t	marks_tail = 0;
+
+void SPI_SlaveInit(uint8_t ss_pin)
+{
+    // Configurer la broche SS comme entrée
+    DDRB &= ~(1 << ss_pin);
+    // MISO is the only output of a slave
+    DDRB |= (1 << DDB4);
+    // Activer le SPI en mode esclave, with the transfer complete interrupt
+    SPCR = (1 << SPE) | (1 << SPIE);
+    // doc 13.2.4 - 13.2.8 : pin change interrupt on SS, PCINT0..7 are PB0..7
+    PCMSK0 |= (1 << ss_pin);
+    PCICR |= (1 << PCIE0);
+}
+
+// from ISRs only
+void	ring_store()
+{
+	uint8_t	c = SPDR;
+	uint8_t	next = ring_head + 1;
+	if (next == ring_tail)
+	{
+		ring_overflows++; // main loop too slow, the byte is lost and the CRC will tell
+		return ;
+	}
+	ring[ring_head] = c;
+	ring_head = next;
+}
+
+// doc 19.3.1 : in slave mode SPIF is set after every byte clocked in by the master,
+// the next byte arrives 8 SCK later so the ISR only stores it
+ISR(SPI_STC_vect)
+{
+	ring_store();
+}
+
+// doc 19.3.2 : SS high resets the slave SPI logic and drops a partial byte, the parser
+// drops a partial frame the same way : every SS edge leaves a mark at the ring position
+// where it happened, the main loop calls link_reset() when it gets there
+ISR(PCINT0_vect)
+{
+	uint8_t	next = (marks_head + 1) & (LINK_MARKS_SIZE - 1);
+
+	// doc 12.4 : PCINT0 comes before SPI_STC, the last byte of the frame may still be
+	// waiting, reading SPSR then SPDR stores it and clears SPIF
+	if (SPSR & (1 << SPIF))
+		ring_store();
+	if (next == marks_tail)
+		return ; // main loop too slow, the CRC still catches a bad frame
+	link_marks[marks_head] = ring_head;
+	marks_head = next;
+}
+
+int	main()
+{
+	uint8_t		c;
+	uint16_t	overflows;
+
+	uart_init();
+	timer1_init();
+	SPI_SlaveInit(DDB2);
+	sei();
+	uart_printstr("SPI link slave\r\n");
+	while (1)
+	{
+		while (1)
+		{
+			if (marks_tail != marks_head && link_marks[marks_tail] == ring_tail)
+			{
+				link_reset();
+				marks_tail = (marks_tail + 1) & (LINK_MARKS_SIZE - 1);
+				continue ;
+			}
+			if (ring_tail == ring_head)
+				break ;
+			c = ring[ring_tail];
+			ring_tail = ring_tail + 1;
+			link_parse(c);
+		}
+		out_poll();
+		if (second)
+		{
+			second = 0;
+			print_stats();
+			cli();
+			overflows = ring_overflows;
+			sei();
+			if (overflows)
+			{
+				out_str("ring overflows : ");
+				out_number(overflows);
+				out_str("\r\n");
+			}
+		}
+	}
+}
+#endif
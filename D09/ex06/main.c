@@ -1,20 +1,43 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
+/*********************ADC SCANNER*************************/
+// RV1 (ADC0) is converted in the background : free running mode (doc 24.9.4 - ADTS = 000),
+// ADC_vect stores every result, so the display loop never waits for a conversion
+volatile uint16_t	adc_value = 0;
+
+ISR(ADC_vect)
+{
+	adc_value = ADC;
+}
+
 void	adc_init()
 {
-	// set Voltage reference to AVcc (01)
-	ADMUX &= ~(1 << REFS1);
-	ADMUX |= (1 << REFS0);
+	// set Voltage reference to AVcc (01), we want potentiometer which is on ADC0 (0000)
+	ADMUX = (1 << REFS0);
 
 	// prescaler for F_CPU  = 128 : frequency 125000 = 125kH (111)
 	ADCSRA |= (1 << ADPS2);
 	ADCSRA |= (1 << ADPS1);
 	ADCSRA |= (1 << ADPS0);
 
-	// Enable ADC (ADEN)
-	ADCSRA |= (1 << ADEN);
+	// doc 24.9.4 - Table 24-6 : trigger source = free running (000)
+	ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));
 
+	// Enable ADC (ADEN), auto trigger (ADATE), interrupt (ADIE) and start the first conversion
+	ADCSRA |= (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADSC);
+}
+
+// latest value, 16 bits written by the ISR : read with interrupts off
+uint16_t	adc_read()
+{
+	uint16_t	value;
+
+	cli();
+	value = adc_value;
+	sei();
+	return (value);
 }
 
 void SPI_MasterInit(void)
@@ -130,6 +153,7 @@ void	i2c_exp_print_number(int count)
 int	main()
 {
 	adc_init();
+	sei();
 	i2c_init();
 	i2c_start();
 
@@ -148,18 +172,7 @@ int	main()
 	i2c_exp_print_number(0);
 	while (1)
 	{
-		// we want potentiometer which is on ADC0 (ADC_POT) (0000)
-		// POTENTIONMETER
-		ADMUX &= ~(1 << MUX3);
-		ADMUX &= ~(1 << MUX2);
-		ADMUX &= ~(1 << MUX1);
-		ADMUX &= ~(1 << MUX0);
-		// start conversion (measurement)
-		// we'll have to wait the end of transmission on ADSC
-		ADCSRA |= (1 << ADSC); // set to 1 for next measurement
-		while (ADCSRA & (1 << ADSC))
-		{}
-		i2c_exp_print_number(ADC);
+		i2c_exp_print_number(adc_read()); // POTENTIOMETER
 	}
 
 